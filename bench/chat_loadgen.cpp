@@ -0,0 +1,491 @@
+// Headless load generator: N WebSocket sessions that speak the chat
+// protocol against a running chat_servidor and measure it from outside.
+// Messages carry their send time, so every receiving session records the
+// end-to-end delivery latency; list and history requests record the time
+// to their response. --idle only connects the sessions and reports the
+// server's resident memory per connection. --batch offers chat.v2.batch,
+// so a server started with --batch may pack several frames into one BATCH
+// message; each is unpacked and handled as if it had arrived on its own.
+//
+// g++ -std=c++17 -O2 bench/chat_loadgen.cpp -o chat_loadgen -lpthread
+// ./chat_loadgen [--host H] [--port P] [--clients N] [--seconds S] [--rate OPS]
+//                [--mix PUBLIC:PRIVATE:LIST:HISTORY:STATUS] [--size BYTES] [--threads T] [--v2 | --batch]
+// ./chat_loadgen --idle --server-pid PID [--port P] [--clients N]
+#define CHAT_SERVIDOR_NO_MAIN
+#include "../chat_servidor.cpp"
+
+#include <random>
+
+struct LoadOptions {
+    std::string host{"127.0.0.1"};
+    std::string port{"8080"};
+    size_t clients{100};
+    int seconds{10};
+    double rate{10.0};                      // operations per second per session
+    std::array<unsigned, 5> mix{{40, 40, 10, 5, 5}};
+    size_t size{64};                        // content bytes per message
+    unsigned int threads{std::max(1u, std::thread::hardware_concurrency())};
+    protocol::WireVersion version{protocol::WireVersion::V1};
+    bool batch{false};                      // implies V2
+    bool idle{false};
+    int server_pid{0};
+};
+
+enum Operation { PUBLIC_SEND, PRIVATE_SEND, LIST, HISTORY, STATUS };
+
+static uint64_t now_ns() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// Shared by every session; the sample vectors are per session and only
+// merged once the io_context has stopped.
+struct Run {
+    const LoadOptions& options;
+    std::vector<std::string> names;
+    std::atomic<size_t> connected{0};
+    std::atomic<size_t> failed{0};
+    std::atomic<bool> stopping{false};
+    std::atomic<uint64_t> sent{0};
+    std::atomic<uint64_t> received{0};
+    std::atomic<uint64_t> batches{0};       // BATCH containers, each counted in received per frame
+
+    explicit Run(const LoadOptions& opts) : options(opts) {}
+};
+
+class LoadSession : public std::enable_shared_from_this<LoadSession> {
+public:
+    std::vector<uint32_t> connect_us;
+    std::vector<uint32_t> delivery_us;
+    std::vector<uint32_t> response_us;
+
+private:
+    Run& run_;
+    size_t index_;
+    tcp::resolver::results_type endpoints_;
+    ws::stream<tcp::socket> ws_;
+    web::flat_buffer buffer_;
+    io::steady_timer timer_;
+    std::deque<std::vector<uint8_t>> outbox_;
+    std::deque<uint64_t> awaiting_list_;
+    std::deque<uint64_t> awaiting_history_;
+    std::mt19937 rng_;
+    uint64_t started_{0};
+    bool away_{false};
+    bool open_{false};
+
+public:
+    LoadSession(io::io_context& context, Run& run, size_t index, tcp::resolver::results_type endpoints)
+        : run_(run),
+          index_(index),
+          endpoints_(std::move(endpoints)),
+          ws_(io::make_strand(context)),
+          timer_(ws_.get_executor()),
+          rng_(static_cast<uint32_t>(index + 1)) {}
+
+    void start() {
+        started_ = now_ns();
+        io::async_connect(ws_.next_layer(), endpoints_,
+            [self = shared_from_this()](web::error_code ec, const tcp::endpoint&) {
+                self->on_connect(ec);
+            });
+    }
+
+    // Called from any thread once every session is connected.
+    void drive() {
+        io::post(ws_.get_executor(), [self = shared_from_this()]() {
+            self->schedule();
+        });
+    }
+
+    void stop() {
+        io::post(ws_.get_executor(), [self = shared_from_this()]() {
+            self->timer_.cancel();
+            if (self->open_) {
+                self->open_ = false;
+                self->ws_.async_close(ws::close_code::normal, [self](web::error_code) {});
+            }
+        });
+    }
+
+private:
+    void on_connect(web::error_code ec) {
+        if (ec) {
+            return fail();
+        }
+        ws_.next_layer().set_option(tcp::no_delay(true), ec);
+        if (run_.options.version == protocol::WireVersion::V2) {
+            // A server without --batch picks plain chat.v2 from the list.
+            std::string offer = run_.options.batch ? 
+                std::string(protocol::V2_BATCH_SUBPROTOCOL) + ", " + protocol::V2_SUBPROTOCOL : protocol::V2_SUBPROTOCOL;
+            ws_.set_option(ws::stream_base::decorator([offer](ws::request_type& req) {
+                req.set(http::field::sec_websocket_protocol, offer);
+            }));
+        }
+        ws_.async_handshake(run_.options.host, "/?name=" + run_.names[index_],
+            [self = shared_from_this()](web::error_code ec) {
+                self->on_handshake(ec);
+            });
+    }
+
+    void on_handshake(web::error_code ec) {
+        if (ec) {
+            return fail();
+        }
+        open_ = true;
+        ws_.binary(true);
+        connect_us.push_back(static_cast<uint32_t>((now_ns() - started_) / 1000));
+        run_.connected++;
+        read_next();
+    }
+
+    void fail() {
+        run_.failed++;
+    }
+
+    void read_next() {
+        ws_.async_read(buffer_, [self = shared_from_this()](web::error_code ec, std::size_t) {
+            self->on_read(ec);
+        });
+    }
+
+    void on_read(web::error_code ec) {
+        if (ec) {
+            open_ = false;
+            timer_.cancel();
+            return;
+        }
+
+        auto frame = buffer_.cdata();
+        if (frame.size() > 0) {
+            on_frame(static_cast<const uint8_t*>(frame.data()), frame.size());
+        }
+        buffer_.consume(buffer_.size());
+        read_next();
+    }
+
+    void on_frame(const uint8_t* data, size_t size) {
+        // [BATCH][count:varint] then count × [len:varint][frame]
+        if (data[0] == protocol::ServerResponse::BATCH) {
+            run_.batches++;
+            RequestReader reader(data + 1, size - 1, protocol::WireVersion::V2);
+            for (uint32_t n = reader.varint(); n > 0 && reader.ok(); n--) {
+                auto frame = reader.string();
+                if (reader.ok() && !frame.empty()) {
+                    on_frame(reinterpret_cast<const uint8_t*>(frame.data()), frame.size());
+                }
+            }
+            return;
+        }
+        
+        run_.received++;
+        uint64_t now = now_ns();
+
+        switch (data[0]) {
+            case protocol::ServerResponse::COMMUNICATION: {
+                RequestReader reader(data + 1, size - 1, run_.options.version);
+                auto sender = reader.string();
+                auto content = reader.string();
+                if (!reader.ok() || sender == run_.names[index_]) {
+                    break;
+                }
+                uint64_t sent_at = std::strtoull(std::string(content.substr(0, content.find('|'))).c_str(), nullptr, 10);
+                if (sent_at > 0 && sent_at <= now) {
+                    delivery_us.push_back(static_cast<uint32_t>((now - sent_at) / 1000));
+                }
+                break;
+            }
+            case protocol::ServerResponse::PARTICIPANT_LIST:
+                record_response(awaiting_list_, now);
+                break;
+            case protocol::ServerResponse::COMMUNICATION_HISTORY:
+                record_response(awaiting_history_, now);
+                break;
+            default:
+                break;
+        }
+    }
+
+    void record_response(std::deque<uint64_t>& awaiting, uint64_t now) {
+        if (!awaiting.empty()) {
+            response_us.push_back(static_cast<uint32_t>((now - awaiting.front()) / 1000));
+            awaiting.pop_front();
+        }
+    }
+
+    // Exponential gaps give a Poisson arrival pattern at the target rate.
+    void schedule() {
+        if (!open_ || run_.stopping) {
+            return;
+        }
+        std::exponential_distribution<double> gap(run_.options.rate);
+        timer_.expires_after(std::chrono::microseconds(static_cast<int64_t>(gap(rng_) * 1e6)));
+        timer_.async_wait([self = shared_from_this()](web::error_code ec) {
+            if (!ec) {
+                self->operate();
+                self->schedule();
+            }
+        });
+    }
+
+    void operate() {
+        const auto& mix = run_.options.mix;
+        std::discrete_distribution<int> pick(mix.begin(), mix.end());
+        auto version = run_.options.version;
+
+        std::vector<uint8_t> frame;
+        int operation = pick(rng_);
+        switch (operation) {
+            case PUBLIC_SEND:
+            case PRIVATE_SEND: {
+                std::string recipient = operation == PUBLIC_SEND ? "~" : random_peer();
+                frame.push_back(protocol::ClientRequest::SEND_COMMUNICATION);
+                ProtocolUtils::append_string(frame, recipient, version);
+                ProtocolUtils::append_string(frame, message_content(), version);
+                break;
+            }
+            case LIST:
+                frame.push_back(protocol::ClientRequest::GET_PARTICIPANTS);
+                awaiting_list_.push_back(now_ns());
+                break;
+            case HISTORY:
+                frame.push_back(protocol::ClientRequest::FETCH_COMMUNICATIONS);
+                ProtocolUtils::append_string(frame, "~", version);
+                awaiting_history_.push_back(now_ns());
+                break;
+            case STATUS:
+                // AVAILABLE and AWAY both receive messages, so this never
+                // parks deliveries in the pending store.
+                away_ = !away_;
+                frame.push_back(protocol::ClientRequest::SET_AVAILABILITY);
+                ProtocolUtils::append_string(frame, run_.names[index_], version);
+                frame.push_back(away_ ? protocol::Availability::AWAY : protocol::Availability::AVAILABLE);
+                break;
+        }
+        run_.sent++;
+        send(std::move(frame));
+    }
+
+    std::string random_peer() {
+        std::uniform_int_distribution<size_t> pick(0, run_.names.size() - 1);
+        size_t peer = pick(rng_);
+        return run_.names[peer == index_ ? (peer + 1) % run_.names.size() : peer];
+    }
+
+    std::string message_content() {
+        std::string content = std::to_string(now_ns()) + "|";
+        if (content.size() < run_.options.size) {
+            content.resize(run_.options.size, 'x');
+        }
+        return content;
+    }
+
+    void send(std::vector<uint8_t> frame) {
+        outbox_.push_back(std::move(frame));
+        if (outbox_.size() == 1) {
+            write_next();
+        }
+    }
+
+    void write_next() {
+        ws_.async_write(io::buffer(outbox_.front()), [self = shared_from_this()](web::error_code ec, std::size_t) {
+            self->outbox_.pop_front();
+            if (!ec && !self->outbox_.empty()) {
+                self->write_next();
+            }
+        });
+    }
+};
+
+static std::string percentile_line(std::vector<uint32_t>& samples, const char* unit) {
+    if (samples.empty()) {
+        return "no samples";
+    }
+    std::sort(samples.begin(), samples.end());
+    auto at = [&samples](double q) {
+        return samples[std::min(samples.size() - 1, static_cast<size_t>(q * samples.size()))];
+    };
+    std::ostringstream out;
+    out << "p50 " << at(0.50) << " " << unit << ", p99 " << at(0.99) << " " << unit
+        << ", p999 " << at(0.999) << " " << unit << ", max " << samples.back() << " " << unit
+        << " (" << samples.size() << " samples)";
+    return out.str();
+}
+
+static long resident_kb(int pid) {
+    std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "VmRSS:") == 0) {
+            return std::stol(line.substr(6));
+        }
+    }
+    return -1;
+}
+
+static void print_usage(const char* program) {
+    std::cerr << "Usage: " << program << " [--host H] [--port P] [--clients N] [--seconds S] [--rate OPS]"
+              << " [--mix PUBLIC:PRIVATE:LIST:HISTORY:STATUS] [--size BYTES] [--threads T] [--v2 | --batch]"
+              << " [--idle --server-pid PID]" << std::endl;
+}
+
+static bool parse_options(int argc, char* argv[], LoadOptions& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string flag = argv[i];
+        if (flag == "--v2") {
+            options.version = protocol::WireVersion::V2;
+            continue;
+        }
+        if (flag == "--batch") {
+            options.version = protocol::WireVersion::V2;
+            options.batch = true;
+            continue;
+        }
+        if (flag == "--idle") {
+            options.idle = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            return false;
+        }
+        std::string value = argv[++i];
+
+        if (flag == "--host") {
+            options.host = value;
+        } else if (flag == "--port") {
+            options.port = value;
+        } else if (flag == "--clients") {
+            options.clients = static_cast<size_t>(std::max(2, std::stoi(value)));
+        } else if (flag == "--seconds") {
+            options.seconds = std::max(1, std::stoi(value));
+        } else if (flag == "--rate") {
+            options.rate = std::max(0.01, std::stod(value));
+        } else if (flag == "--size") {
+            options.size = static_cast<size_t>(std::max(24, std::stoi(value)));
+        } else if (flag == "--threads") {
+            options.threads = static_cast<unsigned int>(std::max(1, std::stoi(value)));
+        } else if (flag == "--server-pid") {
+            options.server_pid = std::stoi(value);
+        } else if (flag == "--mix") {
+            std::vector<std::string> parts;
+            boost::split(parts, value, boost::is_any_of(":"));
+            if (parts.size() != options.mix.size()) {
+                return false;
+            }
+            for (size_t p = 0; p < parts.size(); p++) {
+                options.mix[p] = static_cast<unsigned>(std::stoul(parts[p]));
+            }
+        } else {
+            return false;
+        }
+    }
+    return !options.idle || options.server_pid > 0;
+}
+
+int main(int argc, char* argv[]) {
+    LoadOptions options;
+    if (!parse_options(argc, argv, options)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    io::io_context context;
+    auto work = io::make_work_guard(context);
+    auto endpoints = tcp::resolver(context).resolve(options.host, options.port);
+
+    Run run(options);
+    for (size_t i = 0; i < options.clients; i++) {
+        run.names.push_back("lg" + std::to_string(::getpid()) + "_" + std::to_string(i));
+    }
+
+    std::vector<std::thread> workers;
+    for (unsigned int t = 0; t < options.threads; t++) {
+        workers.emplace_back([&context]() { context.run(); });
+    }
+
+    long rss_before = options.idle ? resident_kb(options.server_pid) : 0;
+
+    // At most 256 handshakes in flight, so the listen backlog never overflows.
+    std::vector<std::shared_ptr<LoadSession>> sessions;
+    auto connect_started = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < options.clients; i++) {
+        while (i - run.connected - run.failed >= 256) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        sessions.push_back(std::make_shared<LoadSession>(context, run, i, endpoints));
+        sessions.back()->start();
+    }
+    while (run.connected + run.failed < options.clients) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    double connect_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - connect_started).count();
+
+    std::vector<uint32_t> connect_us;
+    for (const auto& session : sessions) {
+        connect_us.insert(connect_us.end(), session->connect_us.begin(), session->connect_us.end());
+    }
+    std::cout << "clients=" << options.clients << " connected=" << run.connected << " failed=" << run.failed
+              << " in " << std::fixed << std::setprecision(2) << connect_seconds << " s" << std::endl;
+    std::cout << "connect: " << percentile_line(connect_us, "us") << std::endl;
+
+    if (options.idle) {
+        // Let the server finish its per-connection work (presence fan-out) first.
+        std::this_thread::sleep_for(std::chrono::seconds(2));
+        long rss_after = resident_kb(options.server_pid);
+        std::cout << "server RSS: " << rss_before << " kB -> " << rss_after << " kB, "
+                  << std::setprecision(1) << static_cast<double>(rss_after - rss_before) / std::max<size_t>(1, run.connected)
+                  << " kB per idle connection" << std::endl;
+    } else {
+        for (const auto& session : sessions) {
+            session->drive();
+        }
+        auto started = std::chrono::steady_clock::now();
+        std::this_thread::sleep_for(std::chrono::seconds(options.seconds));
+        run.stopping = true;
+        uint64_t sent = run.sent;
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        uint64_t received = run.received;
+        uint64_t batches = run.batches;
+
+        // Give deliveries already in flight a moment to land.
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+
+        for (auto& session : sessions) {
+            session->stop();
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        work.reset();
+        context.stop();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        workers.clear();
+
+        std::vector<uint32_t> delivery_us;
+        std::vector<uint32_t> response_us;
+        for (const auto& session : sessions) {
+            delivery_us.insert(delivery_us.end(), session->delivery_us.begin(), session->delivery_us.end());
+            response_us.insert(response_us.end(), session->response_us.begin(), session->response_us.end());
+        }
+
+        std::cout << "mix public:private:list:history:status = " << options.mix[0] << ":" << options.mix[1] << ":"
+                  << options.mix[2] << ":" << options.mix[3] << ":" << options.mix[4]
+                  << ", " << options.rate << " ops/s per client, " << options.size << " byte messages, "
+                  << (options.batch ? "v2 batch" : options.version == protocol::WireVersion::V2 ? "v2" : "v1") << std::endl;
+        std::cout << "throughput: " << static_cast<uint64_t>(sent / seconds) << " ops/s sent, "
+                  << static_cast<uint64_t>(received / seconds) << " frames/s received";
+        if (options.batch) {
+            std::cout << " in " << static_cast<uint64_t>(batches / seconds) << " BATCH messages/s";
+        }
+        std::cout << std::endl;
+        std::cout << "delivery latency: " << percentile_line(delivery_us, "us") << std::endl;
+        std::cout << "list/history response: " << percentile_line(response_us, "us") << std::endl;
+    }
+
+    work.reset();
+    context.stop();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    return 0;
+}
@@ -0,0 +1,148 @@
+// Bytes saved against CPU spent by permessage-deflate on the frames the
+// server actually sends, for a few window bits / memory level settings.
+// Compression goes through Beast's deflate_stream the same way the
+// websocket stream does it: a sync flush per message, trailer dropped.
+//
+// g++ -std=c++17 -O2 bench/deflate_bench.cpp -o deflate_bench -lpthread
+// ./deflate_bench [rounds]
+#define CHAT_SERVIDOR_NO_MAIN
+#include "../chat_servidor.cpp"
+
+#include <random>
+
+struct Workload {
+    const char* name;
+    std::vector<std::vector<uint8_t>> frames;
+    bool takeover;      // one stream for the whole sequence, as on a live connection
+};
+
+struct Setting {
+    int window_bits;
+    int mem_level;
+};
+
+static std::string random_sentence(std::mt19937& rng) {
+    static const char* words[] = {
+        "hola", "que", "tal", "el", "proyecto", "servidor", "mañana", "clase", "sistemas",
+        "operativos", "entrega", "hilos", "mensaje", "chat", "listo", "revisen", "commit",
+        "socket", "bien", "gracias", "reunión", "a", "las", "tres", "nos", "vemos", "ok"
+    };
+    std::uniform_int_distribution<size_t> pick(0, sizeof(words) / sizeof(words[0]) - 1);
+    std::uniform_int_distribution<int> length(3, 18);
+
+    std::string sentence;
+    for (int i = length(rng); i > 0; i--) {
+        if (!sentence.empty()) {
+            sentence += ' ';
+        }
+        sentence += words[pick(rng)];
+    }
+    return sentence;
+}
+
+static size_t deflate_frame(web::zlib::deflate_stream& stream, const std::vector<uint8_t>& in,
+                            std::vector<uint8_t>& out) {
+    out.resize(stream.upper_bound(in.size()) + 16);
+    web::zlib::z_params zs;
+    zs.next_in = in.data();
+    zs.avail_in = in.size();
+    zs.next_out = out.data();
+    zs.avail_out = out.size();
+
+    web::error_code ec;
+    stream.write(zs, web::zlib::Flush::sync, ec);
+    // The 00 00 ff ff tail of the sync flush is not sent on the wire.
+    return zs.total_out - 4;
+}
+
+int main(int argc, char* argv[]) {
+    size_t rounds = argc > 1 ? std::stoul(argv[1]) : 20;
+
+    SystemLogger logger("/dev/null");
+    logger.set_console_output(false);
+    ParticipantRegistry registry(logger);
+    CommunicationRepository repository;
+    std::mt19937 rng(42);
+
+    std::vector<std::string> ids;
+    for (int i = 0; i < 500; i++) {
+        ids.push_back("estudiante" + std::to_string(i));
+        registry.register_participant(ids.back(), nullptr, io::ip::address());
+    }
+
+    std::vector<Workload> workloads;
+    {
+        Workload w{"history (255 msgs)", {}, false};
+        for (int i = 0; i < 300; i++) {
+            repository.add_public_communication(ids[rng() % ids.size()], random_sentence(rng));
+        }
+        auto frame = repository.public_history_frame(protocol::WireVersion::V1);
+        w.frames.emplace_back(frame->begin(), frame->end());
+        workloads.push_back(std::move(w));
+    }
+    {
+        Workload w{"participant list", {}, false};
+        auto frame = registry.participant_list_frame().get(protocol::WireVersion::V1);
+        w.frames.emplace_back(frame->begin(), frame->end());
+        workloads.push_back(std::move(w));
+    }
+    {
+        Workload w{"chat messages", {}, true};
+        for (int i = 0; i < 1000; i++) {
+            w.frames.push_back(ProtocolUtils::create_communication_message(
+                ids[rng() % ids.size()], random_sentence(rng)));
+        }
+        workloads.push_back(std::move(w));
+    }
+    {
+        Workload w{"presence updates", {}, true};
+        for (int i = 0; i < 1000; i++) {
+            w.frames.push_back(ProtocolUtils::create_availability_update(
+                ids[rng() % ids.size()], static_cast<protocol::Availability>(1 + rng() % 3)));
+        }
+        workloads.push_back(std::move(w));
+    }
+
+    const Setting settings[] = {{15, 8}, {15, 4}, {12, 4}, {9, 1}};
+    int level = ws::permessage_deflate{}.compLevel;
+
+    std::cout << "compression level " << level << ", " << rounds << " rounds" << std::endl;
+    std::cout << std::left << std::setw(20) << "workload" << std::setw(8) << "wbits" << std::setw(6) << "mem"
+              << std::setw(10) << "raw B" << std::setw(10) << "wire B" << std::setw(8) << "ratio"
+              << std::setw(12) << "ns/frame" << std::setw(10) << "MB/s" << "ns/saved B" << std::endl;
+
+    std::vector<uint8_t> out;
+    for (const auto& w : workloads) {
+        for (const auto& setting : settings) {
+            web::zlib::deflate_stream stream;
+            stream.reset(level, setting.window_bits, setting.mem_level, web::zlib::Strategy::normal);
+
+            size_t raw = 0;
+            size_t wire = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (size_t round = 0; round < rounds; round++) {
+                for (const auto& frame : w.frames) {
+                    if (!w.takeover) {
+                        stream.reset();
+                    }
+                    raw += frame.size();
+                    wire += deflate_frame(stream, frame, out);
+                }
+                stream.reset();
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            size_t frames = rounds * w.frames.size();
+            double saved = raw > wire ? static_cast<double>(raw - wire) : 0.0;
+
+            std::cout << std::left << std::setw(20) << w.name << std::setw(8) << setting.window_bits
+                      << std::setw(6) << setting.mem_level
+                      << std::setw(10) << raw / frames << std::setw(10) << wire / frames
+                      << std::setw(8) << std::fixed << std::setprecision(2) << static_cast<double>(wire) / raw
+                      << std::setw(12) << std::setprecision(0) << seconds * 1e9 / frames
+                      << std::setw(10) << std::setprecision(1) << raw / seconds / 1e6
+                      << std::setprecision(2) << (saved > 0 ? seconds * 1e9 / saved : 0.0) << std::endl;
+        }
+    }
+
+    return 0;
+}
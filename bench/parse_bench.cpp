@@ -0,0 +1,113 @@
+// Counts heap allocations and time per request on the read path: a frame
+// in a flat_buffer, parsed in place by RequestReader and dispatched to
+// RequestHandler. Participants have no connection, so nothing is written.
+//
+// g++ -std=c++17 -O2 bench/parse_bench.cpp -o parse_bench -lpthread
+// ./parse_bench [iterations]
+#define CHAT_SERVIDOR_NO_MAIN
+#include "../chat_servidor.cpp"
+
+#include <cstdlib>
+#include <new>
+
+static std::atomic<uint64_t> allocations{0};
+
+// Kept out of line: once inlined, GCC sees malloc() paired with delete and
+// free() with new, and -Wmismatched-new-delete fires.
+__attribute__((noinline)) void* operator new(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* block = std::malloc(size ? size : 1)) {
+        return block;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* block) noexcept {
+    std::free(block);
+}
+
+__attribute__((noinline)) void operator delete(void* block, std::size_t) noexcept {
+    std::free(block);
+}
+
+struct Case {
+    const char* name;
+    std::vector<uint8_t> frame;
+};
+
+int main(int argc, char* argv[]) {
+    size_t iterations = argc > 1 ? std::stoul(argv[1]) : 100000;
+
+    SystemLogger logger("/dev/null");
+    logger.set_console_output(false);
+    ParticipantRegistry registry(logger);
+    CommunicationRepository repository;
+    RequestHandler handler(registry, repository, logger);
+
+    // Longer than the small-string buffer, so any copy of them allocates.
+    const std::string sender = "alice_the_sender";
+    const std::string recipient = "bob_the_receiver";
+    registry.register_participant(sender, nullptr, io::ip::address());
+    registry.register_participant(recipient, nullptr, io::ip::address());
+
+    std::vector<Case> cases;
+    {
+        Case c{"send public", {protocol::ClientRequest::SEND_COMMUNICATION}};
+        ProtocolUtils::append_string(c.frame, "~", protocol::WireVersion::V1);
+        ProtocolUtils::append_string(c.frame, std::string(120, 'x'), protocol::WireVersion::V1);
+        cases.push_back(c);
+    }
+    {
+        Case c{"send private", {protocol::ClientRequest::SEND_COMMUNICATION}};
+        ProtocolUtils::append_string(c.frame, recipient, protocol::WireVersion::V1);
+        ProtocolUtils::append_string(c.frame, std::string(120, 'x'), protocol::WireVersion::V1);
+        cases.push_back(c);
+    }
+    {
+        Case c{"participant info", {protocol::ClientRequest::PARTICIPANT_INFO}};
+        ProtocolUtils::append_string(c.frame, recipient, protocol::WireVersion::V1);
+        cases.push_back(c);
+    }
+    {
+        Case c{"set availability", {protocol::ClientRequest::SET_AVAILABILITY}};
+        ProtocolUtils::append_string(c.frame, sender, protocol::WireVersion::V1);
+        c.frame.push_back(protocol::Availability::AVAILABLE);
+        cases.push_back(c);
+    }
+    {
+        // Runs after "send public", so it returns a full 255-message history.
+        Case c{"fetch public", {protocol::ClientRequest::FETCH_COMMUNICATIONS}};
+        ProtocolUtils::append_string(c.frame, "~", protocol::WireVersion::V1);
+        cases.push_back(c);
+    }
+
+    std::cout << std::left << std::setw(20) << "request" << std::setw(16) << "allocs/msg" << "ns/msg" << std::endl;
+
+    for (const auto& c : cases) {
+        web::flat_buffer buffer;
+        auto run = [&](size_t count) {
+            for (size_t i = 0; i < count; i++) {
+                auto space = buffer.prepare(c.frame.size());
+                std::memcpy(space.data(), c.frame.data(), c.frame.size());
+                buffer.commit(c.frame.size());
+
+                auto frame = buffer.cdata();
+                RequestReader reader(static_cast<const uint8_t*>(frame.data()), frame.size(), protocol::WireVersion::V1);
+                handler.dispatch(sender, reader);
+                buffer.consume(buffer.size());
+            }
+        };
+
+        run(1000);  // fill the history ring and warm the buffers
+        allocations = 0;
+        auto start = std::chrono::steady_clock::now();
+        run(iterations);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout << std::left << std::setw(20) << c.name
+                  << std::setw(16) << std::fixed << std::setprecision(2) << static_cast<double>(allocations) / iterations
+                  << std::setprecision(0) << seconds * 1e9 / iterations << std::endl;
+    }
+
+    return 0;
+}
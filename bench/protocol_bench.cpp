@@ -0,0 +1,261 @@
+// Encode and decode cost of every protocol message, in both wire versions,
+// at the sizes the server actually sends: lists of 1 to 255 participants
+// and full 255-message histories. Encoders are the ProtocolUtils builders;
+// decoding walks every field with RequestReader, as the server does for
+// requests and a client does for responses. Reports ns, bytes and heap
+// allocations per operation.
+//
+// g++ -std=c++17 -O2 bench/protocol_bench.cpp -o protocol_bench -lpthread
+// ./protocol_bench [iterations] [filter]
+#define CHAT_SERVIDOR_NO_MAIN
+#include "../chat_servidor.cpp"
+
+#include <cstdlib>
+#include <new>
+
+static std::atomic<uint64_t> allocations{0};
+
+// Kept out of line: once inlined, GCC sees malloc() paired with delete and
+// free() with new, and -Wmismatched-new-delete fires.
+__attribute__((noinline)) void* operator new(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* block = std::malloc(size ? size : 1)) {
+        return block;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* block) noexcept {
+    std::free(block);
+}
+
+__attribute__((noinline)) void operator delete(void* block, std::size_t) noexcept {
+    std::free(block);
+}
+
+using Version = protocol::WireVersion;
+
+static size_t sink = 0;
+
+// Runs `op` (which returns the bytes it produced or consumed) and prints
+// one row. Scaled so cheap and expensive cases take comparable time.
+template <typename Op>
+static void measure(const std::string& name, Version version, size_t iterations, const std::string& filter, Op&& op) {
+    if (!filter.empty() && name.find(filter) == std::string::npos) {
+        return;
+    }
+
+    size_t bytes = op();
+    auto probe_start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 10; i++) {
+        sink += op();
+    }
+    double probe = std::chrono::duration<double>(std::chrono::steady_clock::now() - probe_start).count() / 10;
+    size_t runs = std::max<size_t>(100, std::min<size_t>(iterations, static_cast<size_t>(0.2 / std::max(probe, 1e-9))));
+
+    allocations = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < runs; i++) {
+        sink += op();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << std::left << std::setw(44) << name << std::setw(5) << (version == Version::V1 ? "v1" : "v2")
+              << std::right << std::setw(12) << std::fixed << std::setprecision(1) << seconds * 1e9 / runs
+              << std::setw(12) << bytes
+              << std::setw(12) << std::setprecision(2) << static_cast<double>(allocations) / runs << std::endl;
+}
+
+static size_t count(RequestReader& reader) {
+    return reader.version() == Version::V1 ? reader.u8() : reader.u32();
+}
+
+static size_t walk(const std::vector<uint8_t>& frame, Version version) {
+    RequestReader reader(frame.data(), frame.size(), version);
+    size_t fields = 0;
+    switch (reader.u8()) {
+        case protocol::ServerResponse::FAILURE:
+            fields += reader.u8();
+            break;
+        case protocol::ServerResponse::PARTICIPANT_LIST:
+            for (size_t n = count(reader); n > 0 && reader.ok(); n--) {
+                fields += reader.string().size() + reader.u8();
+            }
+            break;
+        case protocol::ServerResponse::PARTICIPANT_DETAILS:
+        case protocol::ServerResponse::PARTICIPANT_JOINED:
+        case protocol::ServerResponse::AVAILABILITY_UPDATE:
+            fields += reader.string().size() + reader.u8();
+            break;
+        case protocol::ServerResponse::COMMUNICATION:
+            fields += reader.string().size() + reader.string().size();
+            break;
+        case protocol::ServerResponse::COMMUNICATION_HISTORY:
+            for (size_t n = count(reader); n > 0 && reader.ok(); n--) {
+                fields += reader.string().size() + reader.string().size();
+            }
+            break;
+        case protocol::ServerResponse::PRESENCE_DELTA: {
+            fields += reader.u8() + reader.u64();
+            for (size_t n = reader.u32(); n > 0 && reader.ok(); n--) {
+                fields += reader.string().size() + reader.u8();
+            }
+            break;
+        }
+        case protocol::ServerResponse::COMMUNICATION_PAGE: {
+            fields += reader.string().size() + reader.u64();
+            size_t entries = reader.u16();
+            fields += reader.u8();
+            for (; entries > 0 && reader.ok(); entries--) {
+                fields += reader.string().size() + reader.u64();
+                fields += version == Version::V1 ? reader.bytes(reader.u16()).size() : reader.string().size();
+            }
+            break;
+        }
+        // Requests, read as the RequestHandler does
+        case protocol::ClientRequest::GET_PARTICIPANTS:
+            break;
+        case protocol::ClientRequest::PARTICIPANT_INFO:
+        case protocol::ClientRequest::FETCH_COMMUNICATIONS:
+            fields += reader.string().size();
+            break;
+        case protocol::ClientRequest::SET_AVAILABILITY:
+            fields += reader.string().size() + reader.u8();
+            break;
+        case protocol::ClientRequest::SEND_COMMUNICATION:
+            fields += reader.string().size() + reader.string().size();
+            break;
+        case protocol::ClientRequest::SYNC_PRESENCE:
+            fields += reader.u64();
+            break;
+        case protocol::ClientRequest::FETCH_PAGE:
+            fields += reader.string().size() + reader.u64() + reader.u16();
+            break;
+    }
+    if (!reader.ok()) {
+        std::cerr << "decode failed for message " << static_cast<int>(frame[0]) << std::endl;
+        std::exit(1);
+    }
+    sink += fields;
+    return frame.size();
+}
+
+int main(int argc, char* argv[]) {
+    size_t iterations = argc > 1 ? std::stoul(argv[1]) : 1000000;
+    std::string filter = argc > 2 ? argv[2] : "";
+
+    std::vector<std::shared_ptr<Participant>> participants;
+    for (int i = 0; i < 255; i++) {
+        participants.push_back(std::make_shared<Participant>("participante_" + std::to_string(i), nullptr, io::ip::address()));
+    }
+    std::vector<std::shared_ptr<Participant>> one(participants.begin(), participants.begin() + 1);
+    std::vector<std::shared_ptr<Participant>> sixteen(participants.begin(), participants.begin() + 16);
+
+    const std::string short_content = "hola, ¿todo bien?";
+    const std::string long_content(255, 'x');
+    const std::string sender = participants[0]->identifier;
+
+    PublicHistoryRing ring(1000, 256 * 1000);
+    std::vector<Communication> private_history;
+    for (int i = 0; i < 1000; i++) {
+        std::string content = "mensaje " + std::to_string(i) + " " + std::string(40 + i % 80, 'm');
+        ring.append(participants[i % 255]->identifier, content.data(), content.size(), std::chrono::system_clock::now());
+        if (i < 255) {
+            private_history.emplace_back(participants[i % 2]->identifier, participants[1 - i % 2]->identifier, content);
+        }
+    }
+
+    std::vector<PresenceChange> changes;
+    for (uint64_t i = 0; i < 255; i++) {
+        changes.push_back({i + 1, participants[i]->identifier, protocol::Availability::AVAILABLE});
+    }
+
+    std::cout << std::left << std::setw(44) << "message" << std::setw(5) << "wire" << std::right
+              << std::setw(12) << "ns/op" << std::setw(12) << "bytes/op" << std::setw(12) << "allocs/op" << std::endl;
+
+    for (Version version : {Version::V1, Version::V2}) {
+        // Server responses: encode, then decode the result.
+        std::vector<std::pair<std::string, std::function<std::vector<uint8_t>()>>> responses = {
+            {"FAILURE", [&]() { return ProtocolUtils::create_error_response(protocol::FailureReason::PARTICIPANT_UNKNOWN); }},
+            {"PARTICIPANT_LIST (1)", [&]() { return ProtocolUtils::create_participant_list(one, version); }},
+            {"PARTICIPANT_LIST (16)", [&]() { return ProtocolUtils::create_participant_list(sixteen, version); }},
+            {"PARTICIPANT_LIST (255)", [&]() { return ProtocolUtils::create_participant_list(participants, version); }},
+            {"PARTICIPANT_DETAILS", [&]() { return ProtocolUtils::create_participant_details(participants[7], version); }},
+            {"PARTICIPANT_JOINED", [&]() { return ProtocolUtils::create_new_participant_notification(sender, version); }},
+            {"AVAILABILITY_UPDATE", [&]() {
+                return ProtocolUtils::create_availability_update(sender, protocol::Availability::BUSY, version);
+            }},
+            {"COMMUNICATION (short)", [&]() { return ProtocolUtils::create_communication_message(sender, short_content, version); }},
+            {"COMMUNICATION (255 B)", [&]() { return ProtocolUtils::create_communication_message(sender, long_content, version); }},
+            {"COMMUNICATION_HISTORY (public 255)", [&]() { return ProtocolUtils::create_history_response(ring, 255, version); }},
+            {"COMMUNICATION_HISTORY (private 255)", [&]() { return ProtocolUtils::create_history_response(private_history, version); }},
+            {"COMMUNICATION_PAGE (100)", [&]() {
+                auto page = ProtocolUtils::create_page_header("~", version);
+                size_t header_size = page.size();
+                size_t entries = 0;
+                uint64_t first = ring.for_each_before(ring.next_sequence(), 100,
+                    [&](const std::string& from, boost::beast::string_view content, std::chrono::system_clock::time_point at) {
+                        ProtocolUtils::append_page_entry(page, from, content, at, version);
+                        entries++;
+                    });
+                ProtocolUtils::finish_page(page, header_size, first, entries, true);
+                return page;
+            }},
+            {"PRESENCE_DELTA (255)", [&]() { return ProtocolUtils::create_presence_delta(true, 255, changes, version); }},
+        };
+
+        for (const auto& response : responses) {
+            measure("encode " + response.first, version, iterations, filter, [&]() { return response.second().size(); });
+            auto frame = response.second();
+            measure("decode " + response.first, version, iterations, filter, [&]() { return walk(frame, version); });
+        }
+
+        // Client requests: encode as a client does, decode as the server does.
+        std::vector<std::pair<std::string, std::function<std::vector<uint8_t>()>>> requests = {
+            {"GET_PARTICIPANTS", [&]() { return std::vector<uint8_t>{protocol::ClientRequest::GET_PARTICIPANTS}; }},
+            {"PARTICIPANT_INFO", [&]() {
+                std::vector<uint8_t> frame = {protocol::ClientRequest::PARTICIPANT_INFO};
+                ProtocolUtils::append_string(frame, sender, version);
+                return frame;
+            }},
+            {"SET_AVAILABILITY", [&]() {
+                std::vector<uint8_t> frame = {protocol::ClientRequest::SET_AVAILABILITY};
+                ProtocolUtils::append_string(frame, sender, version);
+                frame.push_back(protocol::Availability::BUSY);
+                return frame;
+            }},
+            {"SEND_COMMUNICATION (255 B)", [&]() {
+                std::vector<uint8_t> frame = {protocol::ClientRequest::SEND_COMMUNICATION};
+                ProtocolUtils::append_string(frame, "~", version);
+                ProtocolUtils::append_string(frame, long_content, version);
+                return frame;
+            }},
+            {"FETCH_COMMUNICATIONS", [&]() {
+                std::vector<uint8_t> frame = {protocol::ClientRequest::FETCH_COMMUNICATIONS};
+                ProtocolUtils::append_string(frame, "~", version);
+                return frame;
+            }},
+            {"SYNC_PRESENCE", [&]() {
+                std::vector<uint8_t> frame = {protocol::ClientRequest::SYNC_PRESENCE};
+                ProtocolUtils::append_u64(frame, 1234);
+                return frame;
+            }},
+            {"FETCH_PAGE", [&]() {
+                std::vector<uint8_t> frame = {protocol::ClientRequest::FETCH_PAGE};
+                ProtocolUtils::append_string(frame, "~", version);
+                ProtocolUtils::append_u64(frame, 900);
+                frame.push_back(0);
+                frame.push_back(100);
+                return frame;
+            }},
+        };
+
+        for (const auto& request : requests) {
+            measure("encode " + request.first, version, iterations, filter, [&]() { return request.second().size(); });
+            auto frame = request.second();
+            measure("decode " + request.first, version, iterations, filter, [&]() { return walk(frame, version); });
+        }
+    }
+
+    return sink == 0 ? 1 : 0;
+}
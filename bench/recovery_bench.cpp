@@ -0,0 +1,73 @@
+// Measures MessageJournal append throughput and startup recovery time.
+//
+// g++ -std=c++17 -O2 bench/recovery_bench.cpp -o recovery_bench -lpthread
+// ./recovery_bench [messages] [directory]
+#define CHAT_SERVIDOR_NO_MAIN
+#include "../chat_servidor.cpp"
+
+int main(int argc, char* argv[]) {
+    size_t message_count = argc > 1 ? std::stoul(argv[1]) : 10000000;
+    std::string directory = argc > 2 ? argv[2] : "recovery_bench_data";
+
+    std::filesystem::remove_all(directory);
+
+    SystemLogger logger("/dev/null");
+    logger.set_console_output(false);
+
+    std::vector<std::string> senders;
+    for (int i = 0; i < 64; i++) {
+        senders.push_back("user" + std::to_string(i));
+    }
+    std::string content(80, 'x');
+
+    double append_seconds;
+    {
+        MessageJournal journal(directory, logger);
+        journal.open([](const MessageJournal::Entry&) {});
+
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < message_count; i++) {
+            const auto& sender = senders[i % senders.size()];
+            if (i % 10 == 0) {
+                journal.append(MessageJournal::PRIVATE, std::chrono::system_clock::now(), sender,
+                               senders[(i + 1) % senders.size()], content.data(), content.size());
+            } else {
+                journal.append(MessageJournal::PUBLIC, std::chrono::system_clock::now(), sender,
+                               "~", content.data(), content.size());
+            }
+        }
+        if (!journal.flush()) {
+            std::cerr << "journal write failed" << std::endl;
+            return 1;
+        }
+        append_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    uint64_t bytes = 0;
+    for (const auto& file : std::filesystem::directory_iterator(directory)) {
+        bytes += file.file_size();
+    }
+
+    std::cout << "messages=" << message_count << " bytes=" << bytes << std::endl;
+    std::cout << "append+fsync: " << std::fixed << std::setprecision(2) << append_seconds << " s ("
+              << static_cast<uint64_t>(message_count / append_seconds) << " msg/s)" << std::endl;
+
+    // Recovery as the server does it: replay into the public ring and the
+    // restored participants' personal histories.
+    {
+        ParticipantRegistry registry(logger);
+        CommunicationRepository repository;
+        MessageJournal journal(directory, logger);
+
+        auto start = std::chrono::steady_clock::now();
+        size_t replayed = repository.attach_journal(journal, registry);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout << "recovery: " << replayed << " records in " << std::setprecision(3) << seconds << " s ("
+                  << static_cast<uint64_t>(replayed / seconds) << " msg/s, "
+                  << std::setprecision(1) << (bytes / seconds / (1024 * 1024)) << " MiB/s)" << std::endl;
+    }
+
+    std::filesystem::remove_all(directory);
+    return 0;
+}
@@ -0,0 +1,90 @@
+// Microbenchmark for ParticipantRegistry lookups under contention.
+//
+// g++ -std=c++17 -O2 bench/registry_bench.cpp -o registry_bench -lpthread
+// ./registry_bench [participants] [seconds-per-run]
+#define CHAT_SERVIDOR_NO_MAIN
+#include "../chat_servidor.cpp"
+
+#include <random>
+
+struct RunResult {
+    double lookups_per_sec;
+    double snapshots_per_sec;
+};
+
+static RunResult run_threads(ParticipantRegistry& registry, const std::vector<std::string>& ids,
+                             unsigned int threads, std::chrono::milliseconds duration) {
+    std::atomic<bool> go{false};
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> lookups{0};
+    std::atomic<uint64_t> snapshots{0};
+    std::vector<std::thread> workers;
+
+    for (unsigned int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            std::mt19937 rng(t + 1);
+            std::uniform_int_distribution<size_t> pick(0, ids.size() - 1);
+            uint64_t local_lookups = 0;
+            uint64_t local_snapshots = 0;
+            size_t sink = 0;
+
+            while (!go.load(std::memory_order_acquire)) {
+            }
+
+            while (!stop.load(std::memory_order_relaxed)) {
+                // Same mix as a request: a few lookups, occasionally a full list.
+                for (int i = 0; i < 64; i++) {
+                    auto participant = registry.get_participant(ids[pick(rng)]);
+                    sink += participant ? 1 : 0;
+                    local_lookups++;
+                }
+                sink += registry.get_all_participants()->size();
+                local_snapshots++;
+            }
+
+            lookups += local_lookups;
+            snapshots += local_snapshots + (sink == 0 ? 1 : 0);
+        });
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    go.store(true, std::memory_order_release);
+    std::this_thread::sleep_for(duration);
+    stop = true;
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    return {lookups / seconds, snapshots / seconds};
+}
+
+int main(int argc, char* argv[]) {
+    size_t participant_count = argc > 1 ? std::stoul(argv[1]) : 5000;
+    auto duration = std::chrono::milliseconds(argc > 2 ? std::stoi(argv[2]) * 1000 : 1000);
+
+    SystemLogger logger("/dev/null");
+    logger.set_console_output(false);
+    ParticipantRegistry registry(logger);
+
+    std::vector<std::string> ids;
+    for (size_t i = 0; i < participant_count; i++) {
+        ids.push_back("user" + std::to_string(i));
+        registry.register_participant(ids.back(), nullptr, io::ip::address());
+    }
+
+    unsigned int max_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::cout << "participants=" << participant_count << " shards=" << ParticipantRegistry::SHARD_COUNT << std::endl;
+    std::cout << std::left << std::setw(10) << "threads" << std::setw(18) << "lookups/s"
+              << std::setw(18) << "lookups/s/thread" << "snapshots/s" << std::endl;
+
+    for (unsigned int threads = 1; threads <= max_threads * 2; threads *= 2) {
+        auto result = run_threads(registry, ids, threads, duration);
+        std::cout << std::left << std::setw(10) << threads
+                  << std::setw(18) << static_cast<uint64_t>(result.lookups_per_sec)
+                  << std::setw(18) << static_cast<uint64_t>(result.lookups_per_sec / threads)
+                  << static_cast<uint64_t>(result.snapshots_per_sec) << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,126 @@
+// Decoder for the binary event log written by chat_servidor --event-log.
+//
+// g++ -std=c++17 chat_logdecode.cpp -o chat_logdecode -lpthread
+// ./chat_logdecode events.bin
+#define CHAT_SERVIDOR_NO_MAIN
+#include "chat_servidor.cpp"
+
+#include <cstring>
+
+static const char* event_name(uint16_t event) {
+    switch (event) {
+        case events::PARTICIPANT_NAME: return "PARTICIPANT_NAME";
+        case events::CONNECTED: return "CONNECTED";
+        case events::DISCONNECTED: return "DISCONNECTED";
+        case events::AVAILABILITY_CHANGED: return "AVAILABILITY_CHANGED";
+        case events::PUBLIC_MESSAGE: return "PUBLIC_MESSAGE";
+        case events::PRIVATE_MESSAGE: return "PRIVATE_MESSAGE";
+        case events::REQUEST: return "REQUEST";
+        case events::HISTORY_SENT: return "HISTORY_SENT";
+        default: return "UNKNOWN";
+    }
+}
+
+static const char* availability_name(uint16_t status) {
+    switch (status) {
+        case protocol::Availability::OFFLINE: return "OFFLINE";
+        case protocol::Availability::AVAILABLE: return "AVAILABLE";
+        case protocol::Availability::BUSY: return "BUSY";
+        case protocol::Availability::AWAY: return "AWAY";
+        default: return "?";
+    }
+}
+
+static std::string format_timestamp(uint64_t timestamp_us) {
+    std::time_t seconds = static_cast<std::time_t>(timestamp_us / 1000000);
+    std::tm local{};
+    localtime_r(&seconds, &local);
+
+    char stamp[32];
+    std::strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+
+    std::ostringstream out;
+    out << stamp << "." << std::setw(6) << std::setfill('0') << (timestamp_us % 1000000);
+    return out.str();
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 2) {
+        std::cerr << "Usage: " << argv[0] << " <event-log>" << std::endl;
+        return 1;
+    }
+
+    std::ifstream in(argv[1], std::ios::binary);
+    if (!in) {
+        std::cerr << "Cannot open " << argv[1] << std::endl;
+        return 1;
+    }
+
+    uint8_t header[events::HEADER_SIZE];
+    if (!in.read(reinterpret_cast<char*>(header), sizeof(header)) ||
+        std::memcmp(header, events::MAGIC, sizeof(events::MAGIC)) != 0) {
+        std::cerr << argv[1] << " is not an event log" << std::endl;
+        return 1;
+    }
+
+    uint16_t version = static_cast<uint16_t>(header[4] | (header[5] << 8));
+    if (version != events::FORMAT_VERSION) {
+        std::cerr << "Unsupported event log version " << version << std::endl;
+        return 1;
+    }
+
+    std::unordered_map<uint32_t, std::string> names;
+    auto name_of = [&names](uint32_t number) -> std::string {
+        auto it = names.find(number);
+        return it != names.end() ? it->second : "#" + std::to_string(number);
+    };
+
+    uint8_t bytes[events::RECORD_SIZE];
+    while (in.read(reinterpret_cast<char*>(bytes), sizeof(bytes))) {
+        auto record = events::decode(bytes);
+        std::cout << format_timestamp(record.timestamp_us) << " " << event_name(record.event);
+
+        switch (record.event) {
+            case events::PARTICIPANT_NAME: {
+                std::string name(record.size, '\0');
+                if (!in.read(&name[0], static_cast<std::streamsize>(record.size))) {
+                    std::cout << " (truncated)" << std::endl;
+                    return 1;
+                }
+                names[record.participant] = name;
+                std::cout << " #" << record.participant << " = " << name;
+                break;
+            }
+            case events::CONNECTED:
+            case events::DISCONNECTED:
+                std::cout << " " << name_of(record.participant);
+                break;
+            case events::AVAILABILITY_CHANGED:
+                std::cout << " " << name_of(record.participant) << " -> " << availability_name(record.aux);
+                break;
+            case events::PUBLIC_MESSAGE:
+                std::cout << " " << name_of(record.participant) << " size=" << record.size
+                          << " recipients=" << record.aux;
+                break;
+            case events::PRIVATE_MESSAGE:
+                std::cout << " " << name_of(record.participant) << " -> " << name_of(record.peer)
+                          << " size=" << record.size << (record.aux ? " delivered" : " queued");
+                break;
+            case events::REQUEST:
+                std::cout << " " << name_of(record.participant) << " type=" << record.aux
+                          << " size=" << record.size;
+                break;
+            case events::HISTORY_SENT:
+                std::cout << " " << name_of(record.participant) << " channel="
+                          << (record.peer ? name_of(record.peer) : "~") << " size=" << record.size;
+                break;
+            default:
+                std::cout << " participant=" << record.participant << " peer=" << record.peer
+                          << " size=" << record.size << " aux=" << record.aux;
+                break;
+        }
+        std::cout << std::endl;
+    }
+
+    return 0;
+}
@@ -3,9 +3,17 @@
 #include <boost/beast/http.hpp>
 #include <boost/beast/websocket.hpp>
 #include <boost/algorithm/string.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
 #include <ctime>
 #include <deque>
+#include <filesystem>
 #include <fstream>
 #include <functional>
 #include <iomanip>
@@ -16,7 +24,12 @@
 #include <string>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace io = boost::asio;
 namespace web = boost::beast;
@@ -31,7 +44,9 @@ namespace protocol {
         PARTICIPANT_INFO = 2,
         SET_AVAILABILITY = 3,
         SEND_COMMUNICATION = 4,
-        FETCH_COMMUNICATIONS = 5
+        FETCH_COMMUNICATIONS = 5,
+        SYNC_PRESENCE = 6,
+        FETCH_PAGE = 7
     };
 
     enum ServerResponse : uint8_t {
@@ -41,46 +56,297 @@ namespace protocol {
         PARTICIPANT_JOINED = 53,
         AVAILABILITY_UPDATE = 54,
         COMMUNICATION = 55,
-        COMMUNICATION_HISTORY = 56
+        COMMUNICATION_HISTORY = 56,
+        PRESENCE_DELTA = 57,
+        COMMUNICATION_PAGE = 58,
+        BATCH = 59
     };
 
     enum FailureReason : uint8_t {
         PARTICIPANT_UNKNOWN = 1,
         INVALID_AVAILABILITY = 2,
         COMMUNICATION_EMPTY = 3,
-        PARTICIPANT_UNAVAILABLE = 4
+        PARTICIPANT_UNAVAILABLE = 4,
+        COMMUNICATION_TOO_LONG = 5
     };
 
+    // Longest content accepted in SEND_COMMUNICATION. V1 strings already
+    // stop at 255 bytes; this bounds V2, and keeps every stored message
+    // within the u16 content length of a V1 COMMUNICATION_PAGE entry.
+    constexpr size_t MAX_CONTENT_LENGTH = 4096;
+
     enum Availability : uint8_t {
         OFFLINE = 0,
         AVAILABLE = 1,
         BUSY = 2,
         AWAY = 3
     };
+
+    // Frame layout negotiated at handshake. V1 uses one-byte lengths and
+    // counts; V2, requested with the Sec-WebSocket-Protocol below, uses
+    // varint lengths and 32-bit counts. Message codes are the same in both.
+    enum class WireVersion : uint8_t {
+        V1 = 1,
+        V2 = 2
+    };
+
+    constexpr const char* V2_SUBPROTOCOL = "chat.v2";
+
+    // V2 plus BATCH containers; only accepted when the server runs with --batch.
+    constexpr const char* V2_BATCH_SUBPROTOCOL = "chat.v2.batch";
+
+    // Label used for a ClientRequest in metrics; "unknown" for any other byte.
+    inline const char* request_name(uint8_t type) {
+        static const char* const names[] = {
+            "unknown", "get_participants", "participant_info", "set_availability",
+            "send_communication", "fetch_communications", "sync_presence", "fetch_page"
+        };
+        return type < sizeof(names) / sizeof(names[0]) ? names[type] : names[0];
+    }
+}
+
+// Structured binary events
+// The event log is a 6-byte header ("CHEV" + format version) followed by
+// fixed 24-byte little-endian records. PARTICIPANT_NAME records are
+// followed by `size` bytes of the participant's identifier, which maps the
+// numeric ids used by every other record. chat_logdecode turns a file
+// back into text.
+namespace events {
+    constexpr char MAGIC[4] = {'C', 'H', 'E', 'V'};
+    constexpr uint16_t FORMAT_VERSION = 1;
+    constexpr size_t HEADER_SIZE = 6;
+    constexpr size_t RECORD_SIZE = 24;
+
+    enum EventId : uint16_t {
+        PARTICIPANT_NAME = 1,     // size = name length, name bytes follow
+        CONNECTED = 2,
+        DISCONNECTED = 3,
+        AVAILABILITY_CHANGED = 4, // aux = new availability
+        PUBLIC_MESSAGE = 5,       // size = content bytes, aux = recipients
+        PRIVATE_MESSAGE = 6,      // peer = recipient, size = content bytes, aux = 1 if delivered
+        REQUEST = 7,              // aux = ClientRequest, size = frame bytes
+        HISTORY_SENT = 8          // peer = channel owner (0 = public), size = frame bytes
+    };
+
+    struct Record {
+        uint64_t timestamp_us;
+        uint16_t event;
+        uint16_t aux;
+        uint32_t participant;
+        uint32_t peer;
+        uint32_t size;
+    };
+
+    inline void encode(const Record& record, uint8_t* out) {
+        auto put = [&out](uint64_t value, int bytes) {
+            for (int i = 0; i < bytes; i++) {
+                *out++ = static_cast<uint8_t>(value >> (8 * i));
+            }
+        };
+        put(record.timestamp_us, 8);
+        put(record.event, 2);
+        put(record.aux, 2);
+        put(record.participant, 4);
+        put(record.peer, 4);
+        put(record.size, 4);
+    }
+
+    inline Record decode(const uint8_t* in) {
+        auto get = [&in](int bytes) {
+            uint64_t value = 0;
+            for (int i = 0; i < bytes; i++) {
+                value |= static_cast<uint64_t>(*in++) << (8 * i);
+            }
+            return value;
+        };
+        Record record;
+        record.timestamp_us = get(8);
+        record.event = static_cast<uint16_t>(get(2));
+        record.aux = static_cast<uint16_t>(get(2));
+        record.participant = static_cast<uint32_t>(get(4));
+        record.peer = static_cast<uint32_t>(get(4));
+        record.size = static_cast<uint32_t>(get(4));
+        return record;
+    }
 }
 
+enum class LogLevel : uint8_t {
+    DEBUG = 0,
+    INFO = 1,
+    WARN = 2,
+    ERROR = 3
+};
+
+// Evaluates `entry` only when `level` is enabled, so disabled levels cost a
+// single relaxed load and no string building.
+#define SYSTEM_LOG(logger, level, entry) \
+    do { \
+        if ((logger).enabled(level)) { \
+            (logger).record(level, entry); \
+        } \
+    } while (0)
+
+// Bounded lock-free queue (Vyukov). Any number of producers; the logger uses
+// a single consumer, which is all pop() supports.
+template <typename T>
+class BoundedRing {
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+    
+    std::unique_ptr<Cell[]> cells_;
+    size_t mask_;
+    std::atomic<size_t> head_{0};
+    size_t tail_{0};
+
+public:
+    explicit BoundedRing(size_t capacity) : cells_(new Cell[capacity]), mask_(capacity - 1) {
+        for (size_t i = 0; i < capacity; i++) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+    
+    template <typename Fill>
+    bool try_push(Fill&& fill) {
+        size_t pos = head_.load(std::memory_order_relaxed);
+        Cell* cell;
+        
+        for (;;) {
+            cell = &cells_[pos & mask_];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos);
+            
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+        
+        fill(cell->value);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+    
+    template <typename Take>
+    bool pop(Take&& take) {
+        Cell& cell = cells_[tail_ & mask_];
+        if (cell.sequence.load(std::memory_order_acquire) != tail_ + 1) {
+            return false;
+        }
+        
+        take(cell.value);
+        cell.sequence.store(tail_ + mask_ + 1, std::memory_order_release);
+        tail_++;
+        return true;
+    }
+};
+
 // Logging facility
+// In synchronous mode record() formats and writes under a mutex. In
+// asynchronous mode it only pushes the entry into a bounded lock-free ring;
+// a background thread drains it, stamps entries with a cached per-second
+// timestamp, and flushes in batches. Entries that do not fit are dropped
+// and counted. Binary events, when enabled, take the same two paths.
 class SystemLogger {
+public:
+    static constexpr size_t RING_CAPACITY = 8192;   // power of two
+    static constexpr size_t FLUSH_BYTES = 64 * 1024;
+    static constexpr auto FLUSH_INTERVAL = std::chrono::milliseconds(200);
+
 private:
+    struct TextEntry {
+        std::time_t when;
+        std::string text;
+    };
+    
+    struct EventEntry {
+        events::Record record;
+        std::string name;           // PARTICIPANT_NAME only
+    };
+    
     std::mutex mutex_;
     std::ofstream file_;
-    bool console_output_{true};
+    std::ofstream event_file_;
+    std::atomic<bool> console_output_{true};
+    std::atomic<LogLevel> level_{LogLevel::INFO};
+    
+    bool async_;
+    std::unique_ptr<BoundedRing<TextEntry>> ring_;
+    std::unique_ptr<BoundedRing<EventEntry>> event_ring_;
+    std::atomic<uint64_t> dropped_{0};
+    std::atomic<bool> running_{false};
+    std::thread writer_;
 
 public:
-    explicit SystemLogger(const std::string& filename) {
+    explicit SystemLogger(const std::string& filename, bool async = false, 
+                          const std::string& event_filename = "") 
+        : async_(async) {
         file_.open(filename, std::ios::app);
         if (!file_.is_open()) {
             std::cerr << "Failed to open log file: " << filename << std::endl;
         }
+        
+        if (!event_filename.empty()) {
+            open_event_file(event_filename);
+        }
+        
+        if (async_) {
+            ring_ = std::make_unique<BoundedRing<TextEntry>>(RING_CAPACITY);
+            event_ring_ = std::make_unique<BoundedRing<EventEntry>>(RING_CAPACITY);
+            running_ = true;
+            writer_ = std::thread([this]() { writer_loop(); });
+        }
     }
 
     ~SystemLogger() {
+        if (async_) {
+            running_ = false;
+            writer_.join();
+        }
         if (file_.is_open()) {
             file_.close();
         }
     }
+    
+    bool enabled(LogLevel level) const {
+        return level >= level_.load(std::memory_order_relaxed);
+    }
+    
+    bool events_enabled() const {
+        return event_file_.is_open();
+    }
+    
+    void set_level(LogLevel level) {
+        level_ = level;
+    }
 
     void record(const std::string& entry) {
+        record(LogLevel::INFO, entry);
+    }
+    
+    void record(LogLevel level, const std::string& entry) {
+        if (!enabled(level)) {
+            return;
+        }
+        
+        if (async_) {
+            bool pushed = ring_->try_push([&entry](TextEntry& slot) {
+                slot.when = std::time(nullptr);
+                slot.text = entry;
+            });
+            if (!pushed) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+            }
+            return;
+        }
+        
         std::lock_guard<std::mutex> lock(mutex_);
         
         auto now = std::chrono::system_clock::now();
@@ -98,10 +364,397 @@ public:
             std::cout << formatted_entry.str() << std::endl;
         }
     }
+    
+    void event(events::EventId id, uint32_t participant, uint32_t peer = 0, 
+               uint32_t size = 0, uint16_t aux = 0) {
+        if (!events_enabled()) {
+            return;
+        }
+        
+        events::Record record{now_us(), id, aux, participant, peer, size};
+        write_event(record, std::string());
+    }
+    
+    void event_name(uint32_t participant, const std::string& name) {
+        if (!events_enabled()) {
+            return;
+        }
+        
+        events::Record record{now_us(), events::PARTICIPANT_NAME, 0, participant, 0, 
+                              static_cast<uint32_t>(name.size())};
+        write_event(record, name);
+    }
 
     void set_console_output(bool enabled) {
         console_output_ = enabled;
     }
+    
+    uint64_t dropped() const {
+        return dropped_.load();
+    }
+
+private:
+    static uint64_t now_us() {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count());
+    }
+    
+    void open_event_file(const std::string& filename) {
+        event_file_.open(filename, std::ios::binary | std::ios::app);
+        if (!event_file_.is_open()) {
+            std::cerr << "Failed to open event log: " << filename << std::endl;
+            return;
+        }
+        
+        event_file_.seekp(0, std::ios::end);
+        if (event_file_.tellp() == 0) {
+            uint8_t header[events::HEADER_SIZE] = {
+                'C', 'H', 'E', 'V',
+                static_cast<uint8_t>(events::FORMAT_VERSION), 
+                static_cast<uint8_t>(events::FORMAT_VERSION >> 8)
+            };
+            event_file_.write(reinterpret_cast<const char*>(header), sizeof(header));
+            event_file_.flush();
+        }
+    }
+    
+    void write_event(const events::Record& record, const std::string& name) {
+        if (async_) {
+            bool pushed = event_ring_->try_push([&](EventEntry& slot) {
+                slot.record = record;
+                slot.name = name;
+            });
+            if (!pushed) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+            }
+            return;
+        }
+        
+        std::lock_guard<std::mutex> lock(mutex_);
+        append_event(event_file_, record, name);
+        event_file_.flush();
+    }
+    
+    static void append_event(std::ostream& out, const events::Record& record, const std::string& name) {
+        uint8_t bytes[events::RECORD_SIZE];
+        events::encode(record, bytes);
+        out.write(reinterpret_cast<const char*>(bytes), sizeof(bytes));
+        out.write(name.data(), static_cast<std::streamsize>(name.size()));
+    }
+    
+    void writer_loop() {
+        std::string batch;
+        std::string event_batch;
+        std::time_t stamped_second = -1;
+        char stamp[32] = {0};
+        uint64_t reported_drops = 0;
+        auto last_flush = std::chrono::steady_clock::now();
+        auto stamp_second = [&](std::time_t when) {
+            if (when != stamped_second) {
+                std::tm local{};
+                localtime_r(&when, &local);
+                std::strftime(stamp, sizeof(stamp), "[%Y-%m-%d %H:%M:%S] ", &local);
+                stamped_second = when;
+            }
+        };
+        
+        batch.reserve(FLUSH_BYTES * 2);
+        
+        for (;;) {
+            bool stopping = !running_.load();
+            bool drained = true;
+            
+            while (batch.size() < FLUSH_BYTES && ring_->pop([&](TextEntry& entry) {
+                stamp_second(entry.when);
+                batch.append(stamp);
+                batch.append(entry.text);
+                batch.push_back('\n');
+            })) {
+                drained = false;
+            }
+            
+            while (event_batch.size() < FLUSH_BYTES && event_ring_->pop([&](EventEntry& entry) {
+                uint8_t bytes[events::RECORD_SIZE];
+                events::encode(entry.record, bytes);
+                event_batch.append(reinterpret_cast<const char*>(bytes), sizeof(bytes));
+                event_batch.append(entry.name);
+            })) {
+                drained = false;
+            }
+            
+            uint64_t drops = dropped_.load(std::memory_order_relaxed);
+            if (drops != reported_drops) {
+                // Stamped now: the last text entry may be old, or there may be none.
+                stamp_second(std::time(nullptr));
+                batch.append(stamp);
+                batch.append(std::to_string(drops - reported_drops) + " log entries dropped (ring full)\n");
+                reported_drops = drops;
+            }
+            
+            auto now = std::chrono::steady_clock::now();
+            bool flush_due = batch.size() >= FLUSH_BYTES || event_batch.size() >= FLUSH_BYTES ||
+                             now - last_flush >= FLUSH_INTERVAL || stopping;
+            if (flush_due) {
+                if (!batch.empty()) {
+                    if (file_.is_open()) {
+                        file_.write(batch.data(), static_cast<std::streamsize>(batch.size()));
+                        file_.flush();
+                    }
+                    if (console_output_) {
+                        std::cout.write(batch.data(), static_cast<std::streamsize>(batch.size()));
+                        std::cout.flush();
+                    }
+                    batch.clear();
+                }
+                if (!event_batch.empty()) {
+                    event_file_.write(event_batch.data(), static_cast<std::streamsize>(event_batch.size()));
+                    event_file_.flush();
+                    event_batch.clear();
+                }
+                last_flush = now;
+            }
+            
+            if (drained) {
+                if (stopping) {
+                    return;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            }
+        }
+    }
+};
+
+// Encoded server frame. Built once by ProtocolUtils::freeze and shared,
+// never modified, by every queue it is delivered to.
+using SharedFrame = std::shared_ptr<const std::vector<uint8_t>>;
+
+// One server message encoded for each wire version, so broadcasts and
+// pending queues serve v1 and v2 clients without re-encoding per recipient.
+struct VersionedFrame {
+    SharedFrame v1;
+    SharedFrame v2;
+    
+    const SharedFrame& get(protocol::WireVersion version) const {
+        return version == protocol::WireVersion::V2 ? v2 : v1;
+    }
+};
+
+// One presence transition: a join (AVAILABLE for a new or returning user),
+// a status change, or a leave (OFFLINE).
+struct PresenceChange {
+    uint64_t version;
+    std::string identifier;
+    protocol::Availability availability;
+};
+
+// Latency histograms for each ClientRequest type and three phases of a
+// request: parse (reading its fields), handle (the work up to queuing the
+// responses) and write (until the frames queued for the requester are on
+// the socket). Buckets are log-linear as in HdrHistogram: exact below 8 ns,
+// then 8 per power of two, so a bucket is never wider than 12.5% of its
+// values, up to 2^40 ns (about 18 minutes).
+// Each thread records into its own block with plain relaxed stores, so
+// recording never contends and is cheap enough to leave on; readers merge
+// every block. Only the owning thread writes a block, so reset() does not
+// zero them: it keeps the merged counts as a baseline that later
+// snapshots subtract.
+class LatencyRecorder {
+public:
+    enum Phase : uint8_t {
+        PARSE = 0,
+        HANDLE = 1,
+        WRITE = 2
+    };
+    
+    static constexpr size_t PHASES = 3;
+    static constexpr size_t TYPES = protocol::ClientRequest::FETCH_PAGE + 1;   // [0] = unknown
+    static constexpr unsigned SUB_BITS = 3;
+    static constexpr unsigned MAX_BITS = 40;
+    static constexpr size_t BUCKETS = (MAX_BITS - SUB_BITS + 1) << SUB_BITS;
+    
+    struct Histogram {
+        std::array<uint64_t, BUCKETS> counts{};
+        uint64_t count{0};
+        uint64_t sum_ns{0};
+        
+        // Upper bound of the bucket holding the q-quantile, in ns.
+        uint64_t percentile(double q) const {
+            uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * static_cast<double>(count))));
+            uint64_t seen = 0;
+            for (size_t i = 0; i < BUCKETS; i++) {
+                seen += counts[i];
+                if (seen >= rank) {
+                    return upper_bound(i);
+                }
+            }
+            return 0;
+        }
+    };
+    
+    struct Snapshot {
+        std::vector<Histogram> histograms{PHASES * TYPES};
+        
+        const Histogram& at(Phase phase, size_t type) const {
+            return histograms[phase * TYPES + type];
+        }
+    };
+
+private:
+    struct Block {
+        std::array<std::atomic<uint64_t>, PHASES * TYPES * BUCKETS> counts{};
+        std::array<std::atomic<uint64_t>, PHASES * TYPES> sums{};
+    };
+    
+    static std::atomic<uint64_t> next_id_;
+    
+    uint64_t id_{++next_id_};
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Block>> blocks_;
+    Snapshot baseline_;
+
+public:
+    void record(Phase phase, uint8_t type, std::chrono::steady_clock::duration elapsed) {
+        int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        size_t slot = phase * TYPES + (type < TYPES ? type : 0);
+        Block& block = local();
+        bump(block.counts[slot * BUCKETS + bucket(ns > 0 ? static_cast<uint64_t>(ns) : 0)], 1);
+        bump(block.sums[slot], ns > 0 ? static_cast<uint64_t>(ns) : 0);
+    }
+    
+    // Counts since startup or the last reset().
+    Snapshot snapshot() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return since_baseline_locked(merge_locked());
+    }
+    
+    void reset() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        baseline_ = merge_locked();
+    }
+    
+    // snapshot() and reset() from the same merge, so no sample recorded
+    // between them is lost.
+    Snapshot snapshot_and_reset() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Snapshot merged = merge_locked();
+        Snapshot result = since_baseline_locked(merged);
+        baseline_ = std::move(merged);
+        return result;
+    }
+    
+    static size_t bucket(uint64_t ns) {
+        if (ns < (uint64_t{1} << SUB_BITS)) {
+            return static_cast<size_t>(ns);
+        }
+        ns = std::min(ns, (uint64_t{1} << MAX_BITS) - 1);
+        unsigned exponent = 63 - static_cast<unsigned>(__builtin_clzll(ns));
+        size_t sub = static_cast<size_t>(ns >> (exponent - SUB_BITS)) & ((size_t{1} << SUB_BITS) - 1);
+        return (static_cast<size_t>(exponent - SUB_BITS + 1) << SUB_BITS) + sub;
+    }
+    
+    static uint64_t upper_bound(size_t bucket) {
+        if (bucket < (size_t{1} << SUB_BITS)) {
+            return bucket + 1;
+        }
+        size_t group = bucket >> SUB_BITS;
+        uint64_t sub = bucket & ((size_t{1} << SUB_BITS) - 1);
+        return ((uint64_t{1} << SUB_BITS) + sub + 1) << (group - 1);
+    }
+
+private:
+    // Only the owning thread writes, so no read-modify-write is needed.
+    static void bump(std::atomic<uint64_t>& cell, uint64_t amount) {
+        cell.store(cell.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+    
+    // The calling thread's block for this recorder, created on its first
+    // sample. Each thread keeps one entry per recorder it has used, keyed
+    // by id, which is never reused; the last hit is checked first since a
+    // thread almost always records into the same one.
+    Block& local() {
+        thread_local std::vector<std::pair<uint64_t, Block*>> owned;
+        thread_local size_t last = 0;
+        if (last < owned.size() && owned[last].first == id_) {
+            return *owned[last].second;
+        }
+        for (last = 0; last < owned.size(); last++) {
+            if (owned[last].first == id_) {
+                return *owned[last].second;
+            }
+        }
+        
+        std::lock_guard<std::mutex> lock(mutex_);
+        blocks_.push_back(std::make_unique<Block>());
+        owned.emplace_back(id_, blocks_.back().get());
+        return *owned[last].second;
+    }
+    
+    Snapshot since_baseline_locked(Snapshot merged) const {
+        for (size_t slot = 0; slot < PHASES * TYPES; slot++) {
+            auto& histogram = merged.histograms[slot];
+            const auto& base = baseline_.histograms[slot];
+            for (size_t i = 0; i < BUCKETS; i++) {
+                histogram.counts[i] -= base.counts[i];
+            }
+            histogram.count -= base.count;
+            histogram.sum_ns -= base.sum_ns;
+        }
+        return merged;
+    }
+    
+    Snapshot merge_locked() const {
+        Snapshot merged;
+        for (const auto& block : blocks_) {
+            for (size_t slot = 0; slot < PHASES * TYPES; slot++) {
+                auto& histogram = merged.histograms[slot];
+                for (size_t i = 0; i < BUCKETS; i++) {
+                    uint64_t n = block->counts[slot * BUCKETS + i].load(std::memory_order_relaxed);
+                    histogram.counts[i] += n;
+                    histogram.count += n;
+                }
+                histogram.sum_ns += block->sums[slot].load(std::memory_order_relaxed);
+            }
+        }
+        return merged;
+    }
+};
+
+std::atomic<uint64_t> LatencyRecorder::next_id_{0};
+
+// Process-wide counters, updated lock-free from any strand
+struct SystemMetrics {
+    std::atomic<uint64_t> outbound_frames_queued{0};
+    std::atomic<uint64_t> outbound_bytes_queued{0};
+    std::atomic<uint64_t> outbound_frames_dropped{0};     // presence updates shed by a full queue
+    std::atomic<uint64_t> outbound_evictions{0};          // connections closed for exceeding their budget
+    std::atomic<uint64_t> outbound_batches{0};
+    std::atomic<uint64_t> outbound_batched_frames{0};
+    std::atomic<uint64_t> connections_accepted{0};
+    std::atomic<uint64_t> connections_rejected{0};
+    std::array<std::atomic<uint64_t>, protocol::ClientRequest::FETCH_PAGE + 1> requests{};  // by type; [0] = unknown
+    LatencyRecorder latency;
+};
+
+// Recipients per broadcast, bucketed by powers of four: <= 1, 4, 16, ...
+// 4096, and everything above in the last bucket.
+struct FanoutHistogram {
+    static constexpr size_t BUCKETS = 8;
+    
+    std::array<std::atomic<uint64_t>, BUCKETS> counts{};
+    std::atomic<uint64_t> sum{0};
+    
+    static uint64_t upper_bound(size_t bucket) {
+        return uint64_t{1} << (2 * bucket);
+    }
+    
+    void record(size_t recipients) {
+        size_t bucket = 0;
+        while (bucket + 1 < BUCKETS && recipients > upper_bound(bucket)) {
+            bucket++;
+        }
+        counts[bucket].fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(recipients, std::memory_order_relaxed);
+    }
 };
 
 // Communication record
@@ -118,297 +771,2427 @@ struct Communication {
           timestamp(std::chrono::system_clock::now()) {}
 };
 
-// Forward declarations
-class ParticipantRegistry;
-class CommunicationRepository;
-class RequestHandler;
-class ConnectionHandler;
-class ProtocolUtils;
+// Fixed-capacity ring of public messages. Content bytes live in one
+// contiguous arena and senders are interned to small ids, so once every
+// sender has been seen an append never allocates. Each message occupies a
+// contiguous arena range; a message that would straddle the end of the
+// arena starts again at offset 0, and the oldest messages are evicted
+// until both a slot and the bytes are free. Messages are numbered from 1 in
+// append order; the retained ones always form one contiguous range, so a
+// sequence number maps straight to its slot.
+class PublicHistoryRing {
+private:
+    struct Slot {
+        uint64_t offset;        // logical position; arena index is offset % arena size
+        uint32_t length;
+        uint32_t sender;
+        int64_t timestamp;      // system_clock ticks
+    };
+    
+    std::vector<Slot> slots_;
+    std::vector<char> arena_;
+    std::unordered_map<std::string, uint32_t> sender_ids_;
+    std::vector<std::string> sender_names_;
+    size_t first_{0};           // index of the oldest slot
+    size_t count_{0};
+    uint64_t first_sequence_{1};    // sequence number of the oldest slot
+    uint64_t write_offset_{0};
+    uint64_t payload_bytes_{0};
 
-// System participant
-class Participant {
 public:
-    std::string identifier;
-    protocol::Availability availability;
-    std::shared_ptr<ws::stream<tcp::socket>> connection;
-    std::deque<Communication> personal_history;
-    std::deque<std::vector<uint8_t>> mensajes_pendientes;
-    std::chrono::system_clock::time_point last_activity;
-    io::ip::address network_address;
-    
-    Participant(std::string id, std::shared_ptr<ws::stream<tcp::socket>> conn, 
-                io::ip::address addr)
-        : identifier(std::move(id)), 
-          availability(protocol::Availability::AVAILABLE), 
-          connection(std::move(conn)),
-          last_activity(std::chrono::system_clock::now()),
-          network_address(std::move(addr)) {}
+    PublicHistoryRing(size_t capacity, size_t arena_bytes) 
+        : slots_(capacity), arena_(arena_bytes) {}
     
-    bool is_available() const {
-        return availability == protocol::Availability::AVAILABLE;
+    size_t size() const {
+        return count_;
     }
     
-    bool can_receive_communications() const {
-        return availability != protocol::Availability::OFFLINE;
+    size_t capacity() const {
+        return slots_.size();
     }
     
-    
-    void update_last_activity() {
-        last_activity = std::chrono::system_clock::now();
+    uint64_t first_sequence() const {
+        return first_sequence_;
     }
-};
-
-// Protocol utilities
-class ProtocolUtils {
-public:
-    static std::vector<uint8_t> create_error_response(protocol::FailureReason reason) {
-        return {protocol::ServerResponse::FAILURE, static_cast<uint8_t>(reason)};
+    
+    uint64_t next_sequence() const {
+        return first_sequence_ + count_;
     }
     
-    static std::vector<uint8_t> create_participant_list(const std::vector<std::shared_ptr<Participant>>& participants) {
-        uint8_t count = static_cast<uint8_t>(std::min(participants.size(), static_cast<size_t>(255)));
+    void append(const std::string& sender, const char* content, size_t length,
+                std::chrono::system_clock::time_point timestamp) {
+        length = std::min(length, arena_.size());
         
-        std::vector<uint8_t> response = {protocol::ServerResponse::PARTICIPANT_LIST, count};
+        uint64_t start = write_offset_;
+        size_t position = static_cast<size_t>(start % arena_.size());
+        if (position + length > arena_.size()) {
+            start += arena_.size() - position;
+            position = 0;
+        }
         
-        for (size_t i = 0; i < count; i++) {
-            const auto& participant = participants[i];
-            
-            uint8_t id_length = static_cast<uint8_t>(participant->identifier.size());
-            response.push_back(id_length);
-            response.insert(response.end(), participant->identifier.begin(), participant->identifier.end());
-            response.push_back(static_cast<uint8_t>(participant->availability));
+        while (count_ > 0 && (count_ == slots_.size() || start + length - slots_[first_].offset > arena_.size())) {
+            payload_bytes_ -= slots_[first_].length;
+            first_ = (first_ + 1) % slots_.size();
+            first_sequence_++;
+            count_--;
         }
         
-        return response;
+        std::memcpy(arena_.data() + position, content, length);
+        
+        Slot& slot = slots_[(first_ + count_) % slots_.size()];
+        slot.offset = start;
+        slot.length = static_cast<uint32_t>(length);
+        slot.sender = intern(sender);
+        slot.timestamp = timestamp.time_since_epoch().count();
+        
+        count_++;
+        payload_bytes_ += length;
+        write_offset_ = start + length;
     }
     
-    static std::vector<uint8_t> create_participant_details(const std::shared_ptr<Participant>& participant) {
-        if (!participant) {
-            return create_error_response(protocol::FailureReason::PARTICIPANT_UNKNOWN);
+    // Visits the newest `max_count` messages, oldest first.
+    template <typename Visitor>
+    void for_each_last(size_t max_count, Visitor&& visit) const {
+        size_t count = std::min(count_, max_count);
+        for (size_t i = count_ - count; i < count_; i++) {
+            const Slot& slot = slots_[(first_ + i) % slots_.size()];
+            visit(sender_names_[slot.sender], 
+                  boost::beast::string_view(arena_.data() + slot.offset % arena_.size(), slot.length),
+                  std::chrono::system_clock::time_point(std::chrono::system_clock::duration(slot.timestamp)));
+        }
+    }
+    
+    // Visits up to `max_count` messages numbered below `before` (0 = from
+    // the newest), oldest first, and returns the first sequence visited.
+    template <typename Visitor>
+    uint64_t for_each_before(uint64_t before, size_t max_count, Visitor&& visit) const {
+        uint64_t end = (before == 0 || before > next_sequence()) ? next_sequence() : std::max(before, first_sequence_);
+        uint64_t begin = end - std::min<uint64_t>(end - first_sequence_, max_count);
+        for (uint64_t sequence = begin; sequence < end; sequence++) {
+            const Slot& slot = slots_[(first_ + (sequence - first_sequence_)) % slots_.size()];
+            visit(sender_names_[slot.sender], 
+                  boost::beast::string_view(arena_.data() + slot.offset % arena_.size(), slot.length),
+                  std::chrono::system_clock::time_point(std::chrono::system_clock::duration(slot.timestamp)));
+        }
+        return begin;
+    }
+    
+    // Live payload plus slot bookkeeping; the fixed arena and slot array
+    // are allocated once up front.
+    size_t bytes_used() const {
+        return static_cast<size_t>(payload_bytes_) + count_ * sizeof(Slot);
+    }
+    
+    double bytes_per_message() const {
+        return count_ == 0 ? 0.0 : static_cast<double>(bytes_used()) / static_cast<double>(count_);
+    }
+
+private:
+    uint32_t intern(const std::string& sender) {
+        auto it = sender_ids_.find(sender);
+        if (it != sender_ids_.end()) {
+            return it->second;
         }
         
-        std::vector<uint8_t> response = {
-            protocol::ServerResponse::PARTICIPANT_DETAILS, 
-            static_cast<uint8_t>(participant->identifier.size())
-        };
+        auto id = static_cast<uint32_t>(sender_names_.size());
+        sender_names_.push_back(sender);
+        sender_ids_.emplace(sender, id);
+        return id;
+    }
+};
+
+// Forward declarations
+class ParticipantRegistry;
+class CommunicationRepository;
+class RequestHandler;
+class ConnectionHandler;
+class ProtocolUtils;
+
+// How an OutboundQueue coalesces frames for a client that negotiated
+// batching. Frames that pile up while a write is in flight always go out
+// together; a non-zero flush_deadline also holds the first frame of a
+// burst back for up to that long so more can join it.
+struct BatchPolicy {
+    bool enabled{false};
+    std::chrono::milliseconds flush_deadline{0};
+};
+
+// Most a connection's outbound queue may hold, written or not. A client
+// over budget first loses its oldest queued presence updates, which it can
+// recover with SYNC_PRESENCE; if that is not enough it is disconnected.
+struct OutboundBudget {
+    size_t max_frames{4096};
+    size_t max_bytes{4 * 1024 * 1024};
+};
+
+// permessage-deflate settings offered to clients. Beast negotiates the
+// extension per connection during the handshake. Where Beast supports it,
+// messages shorter than min_size are sent uncompressed, since deflating a
+// presence update costs more CPU than the few bytes it saves; with older
+// Beast (e.g. Boost 1.74) min_size has no effect and every message is
+// compressed.
+struct DeflatePolicy {
+    bool enabled{false};
+    size_t min_size{256};
+    int window_bits{15};        // 9..15, applies to both directions
+    int mem_level{4};           // 1..9
+    
+    // The size threshold is a Beast option only in newer releases; older
+    // ones compress every message once the extension is negotiated.
+    static constexpr bool supports_min_size() {
+        return has_size_threshold<ws::permessage_deflate>(0);
+    }
+    
+    ws::permessage_deflate option() const {
+        ws::permessage_deflate deflate;
+        deflate.server_enable = enabled;
+        deflate.server_max_window_bits = window_bits;
+        deflate.client_max_window_bits = window_bits;
+        deflate.memLevel = mem_level;
+        set_size_threshold(deflate, min_size, 0);
+        return deflate;
+    }
+
+private:
+    template <class Option>
+    static constexpr auto has_size_threshold(int) -> decltype(std::declval<Option&>().msg_size_threshold, bool()) {
+        return true;
+    }
+    template <class Option>
+    static constexpr bool has_size_threshold(long) {
+        return false;
+    }
+    
+    template <class Option>
+    static auto set_size_threshold(Option& deflate, size_t size, int) -> decltype(deflate.msg_size_threshold = size, void()) {
+        deflate.msg_size_threshold = size;
+    }
+    template <class Option>
+    static void set_size_threshold(Option&, size_t, long) {}
+};
+
+// Bounded outbound queue of one WebSocket connection. Producers on any
+// thread only append; the connection's strand drains it with async writes,
+// so a stalled peer never blocks the sender, and OutboundBudget caps what
+// it can cost in memory. With batching, every frame
+// waiting when a write starts is packed into one BATCH container, which
+// costs one WebSocket message and one socket write.
+class OutboundQueue : public std::enable_shared_from_this<OutboundQueue> {
+public:
+    static constexpr size_t MAX_BATCH_BYTES = 64 * 1024;
+    static constexpr size_t MAX_WRITE_MARKS = 256;
+
+private:
+    // A request waiting for its responses to be written: done once
+    // `settled_` reaches `frames`.
+    struct WriteMark {
+        uint64_t frames;
+        uint8_t type;
+        std::chrono::steady_clock::time_point handled;
+    };
+    
+
+    std::shared_ptr<ws::stream<tcp::socket>> stream_;
+    std::string owner_;
+    SystemLogger& logger_;
+    SystemMetrics& metrics_;
+    std::mutex mutex_;
+    std::deque<SharedFrame> frames_;
+    size_t queued_bytes_{0};
+    size_t in_flight_{0};       // frames at the front of frames_ being written
+    bool writing_{false};       // a write or a flush timer is pending
+    bool closed_{false};
+    protocol::WireVersion version_;
+    BatchPolicy batch_;
+    OutboundBudget budget_;
+    std::unique_ptr<io::steady_timer> flush_timer_;
+    std::vector<uint8_t> batch_buffer_;     // only touched on the strand
+    std::function<void()> on_drained_;
+    uint64_t settled_{0};                   // frames written or shed so far
+    std::deque<WriteMark> write_marks_;
+
+public:
+    OutboundQueue(std::shared_ptr<ws::stream<tcp::socket>> stream, std::string owner,
+                  SystemLogger& logger, SystemMetrics& metrics, 
+                  protocol::WireVersion version = protocol::WireVersion::V1,
+                  BatchPolicy batch = {},
+                  OutboundBudget budget = {})
+        : stream_(std::move(stream)), 
+          owner_(std::move(owner)), 
+          logger_(logger), 
+          metrics_(metrics),
+          version_(version),
+          batch_(batch),
+          budget_(budget) {
+        if (batch_.enabled && batch_.flush_deadline.count() > 0) {
+            flush_timer_ = std::make_unique<io::steady_timer>(stream_->get_executor());
+        }
+    }
+    
+    ~OutboundQueue() {
+        close();
+    }
+    
+    protocol::WireVersion version() const {
+        return version_;
+    }
+    
+    const OutboundBudget& budget() const {
+        return budget_;
+    }
+    
+    bool enqueue(SharedFrame frame) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (closed_) {
+            return false;
+        }
+        if (!fits_locked(frame->size()) && !make_room_locked(frame)) {
+            return false;
+        }
+        
+        metrics_.outbound_frames_queued++;
+        metrics_.outbound_bytes_queued += frame->size();
+        queued_bytes_ += frame->size();
+        frames_.push_back(std::move(frame));
+        
+        wake_locked(queued_bytes_ >= MAX_BATCH_BYTES);
+        return true;
+    }
+    
+    // Queues a run of frames back to back, all or none, with one lock and
+    // one wake-up of the strand. The run is already a burst, so it skips
+    // the flush deadline; a batching client gets it in as few BATCH
+    // containers as fit. Over budget nothing is queued or shed, and the
+    // caller should retry from when_drained().
+    bool enqueue_bulk(const std::vector<SharedFrame>& run) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (closed_) {
+            return false;
+        }
+        
+        size_t bytes = 0;
+        for (const auto& frame : run) {
+            bytes += frame->size();
+        }
+        if (!frames_.empty() &&
+            (frames_.size() + run.size() > budget_.max_frames || queued_bytes_ + bytes > budget_.max_bytes)) {
+            return false;
+        }
+        
+        metrics_.outbound_frames_queued += run.size();
+        metrics_.outbound_bytes_queued += bytes;
+        queued_bytes_ += bytes;
+        frames_.insert(frames_.end(), run.begin(), run.end());
+        
+        wake_locked(true);
+        return true;
+    }
+    
+    size_t depth() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return frames_.size();
+    }
+    
+    // Runs `callback` on the strand once every frame queued so far has
+    // been written. Only the latest callback is kept.
+    void when_drained(std::function<void()> callback) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (closed_) {
+            return;
+        }
+        on_drained_ = std::move(callback);
+        if (!writing_) {
+            writing_ = true;
+            io::post(stream_->get_executor(), [self = shared_from_this()]() {
+                self->write_next();
+            });
+        }
+    }
+    
+    // Records the write latency of request `type` once every frame queued
+    // so far has left; nothing is recorded if the queue is already empty.
+    void time_write(uint8_t type, std::chrono::steady_clock::time_point handled) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (closed_ || frames_.empty() || write_marks_.size() >= MAX_WRITE_MARKS) {
+            return;
+        }
+        write_marks_.push_back({settled_ + frames_.size(), type, handled});
+    }
+    
+    // Discards anything still queued; later enqueues are refused.
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        on_drained_ = nullptr;
+        write_marks_.clear();
+        release_locked(in_flight_);
+    }
+
+private:
+    // Starts the strand draining the queue if it is idle. A batching queue
+    // first waits out the flush deadline unless `now`; `now` also cuts
+    // short a deadline that is already running.
+    void wake_locked(bool now) {
+        if (!writing_) {
+            writing_ = true;
+            if (flush_timer_ && !now) {
+                // On the strand, like every other use of the timer.
+                io::post(stream_->get_executor(), [self = shared_from_this()]() {
+                    self->flush_timer_->expires_after(self->batch_.flush_deadline);
+                    self->flush_timer_->async_wait([self](web::error_code) {
+                        self->write_next();
+                    });
+                });
+            } else {
+                io::post(stream_->get_executor(), [self = shared_from_this()]() {
+                    self->write_next();
+                });
+            }
+        } else if (flush_timer_ && now && in_flight_ == 0) {
+            // A batch is waiting on the deadline; send it now.
+            io::post(stream_->get_executor(), [self = shared_from_this()]() {
+                self->flush_timer_->cancel();
+            });
+        }
+    }
+    
+    bool fits_locked(size_t size) const {
+        // A lone frame is always accepted, however large.
+        return frames_.empty() ||
+               (frames_.size() < budget_.max_frames && queued_bytes_ + size <= budget_.max_bytes);
+    }
+    
+    static bool is_presence(const SharedFrame& frame) {
+        uint8_t code = (*frame)[0];
+        return code == protocol::ServerResponse::PARTICIPANT_JOINED ||
+               code == protocol::ServerResponse::AVAILABILITY_UPDATE ||
+               code == protocol::ServerResponse::PRESENCE_DELTA;
+    }
+    
+    // Over budget: sheds queued presence updates oldest first, or the new
+    // frame itself if it is one. Anything else that does not fit evicts
+    // the client. Returns whether the new frame should be queued.
+    bool make_room_locked(const SharedFrame& frame) {
+        bool incoming_presence = is_presence(frame);
+        for (size_t i = in_flight_; i < frames_.size() && !fits_locked(frame->size()); ) {
+            if (is_presence(frames_[i])) {
+                metrics_.outbound_frames_queued--;
+                metrics_.outbound_bytes_queued -= frames_[i]->size();
+                queued_bytes_ -= frames_[i]->size();
+                frames_.erase(frames_.begin() + static_cast<std::ptrdiff_t>(i));
+                metrics_.outbound_frames_dropped++;
+                settled_++;
+            } else {
+                i++;
+            }
+        }
+        if (fits_locked(frame->size())) {
+            return true;
+        }
+        if (incoming_presence) {
+            metrics_.outbound_frames_dropped++;
+            return false;
+        }
+        
+        evict_locked();
+        return false;
+    }
+    
+    // The queued frames are discarded and the client is sent a close frame
+    // with the reason; its read loop then ends and marks it OFFLINE.
+    void evict_locked() {
+        SYSTEM_LOG(logger_, LogLevel::WARN, "Desconectando a " + owner_ + ": cola de salida llena (" +
+                   std::to_string(frames_.size()) + " tramas, " + std::to_string(queued_bytes_) + " bytes)");
+        closed_ = true;
+        on_drained_ = nullptr;
+        write_marks_.clear();
+        release_locked(in_flight_);
+        metrics_.outbound_evictions++;
+        
+        io::post(stream_->get_executor(), [self = shared_from_this()]() {
+            self->stream_->async_close(ws::close_reason(ws::close_code::policy_error, "slow consumer"),
+                [self](web::error_code) {});
+        });
+    }
+    
+    // Runs on the connection's strand. Frames being written stay in the
+    // deque until the write completes, which keeps their bytes alive.
+    void write_next() {
+        SharedFrame frame;
+        std::function<void()> drained;
+        bool idle = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (frames_.empty()) {
+                writing_ = false;
+                idle = true;
+                drained = std::move(on_drained_);
+                on_drained_ = nullptr;
+            } else if (!batch_.enabled || frames_.size() == 1) {
+                in_flight_ = 1;
+                frame = frames_.front();
+            } else {
+                pack_batch_locked();
+            }
+        }
+        
+        if (idle) {
+            if (drained) {
+                drained();
+            }
+            return;
+        }
+        
+        io::const_buffer buffer = frame ? io::const_buffer(frame->data(), frame->size())
+                                        : io::const_buffer(batch_buffer_.data(), batch_buffer_.size());
+        stream_->async_write(buffer,
+            [self = shared_from_this()](web::error_code ec, std::size_t) {
+                self->on_write(ec);
+            });
+    }
+    
+    // [BATCH][count:varint] then per frame [length:varint][frame], for as
+    // many queued frames as fit in MAX_BATCH_BYTES (at least one).
+    void pack_batch_locked() {
+        batch_buffer_.clear();
+        batch_buffer_.push_back(protocol::ServerResponse::BATCH);
+        
+        size_t count = 0;
+        size_t bytes = 0;
+        while (count < frames_.size() && (count == 0 || bytes + frames_[count]->size() <= MAX_BATCH_BYTES)) {
+            bytes += frames_[count]->size();
+            count++;
+        }
+        
+        append_varint(batch_buffer_, count);
+        for (size_t i = 0; i < count; i++) {
+            append_varint(batch_buffer_, frames_[i]->size());
+            batch_buffer_.insert(batch_buffer_.end(), frames_[i]->begin(), frames_[i]->end());
+        }
+        
+        in_flight_ = count;
+        metrics_.outbound_batches++;
+        metrics_.outbound_batched_frames += count;
+    }
+    
+    static void append_varint(std::vector<uint8_t>& out, size_t value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<uint8_t>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<uint8_t>(value));
+    }
+    
+    void on_write(web::error_code ec) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (; in_flight_ > 0 && !frames_.empty(); in_flight_--) {
+                metrics_.outbound_frames_queued--;
+                metrics_.outbound_bytes_queued -= frames_.front()->size();
+                queued_bytes_ -= frames_.front()->size();
+                frames_.pop_front();
+                settled_++;
+            }
+            in_flight_ = 0;
+            
+            if (!ec && !write_marks_.empty() && write_marks_.front().frames <= settled_) {
+                auto now = std::chrono::steady_clock::now();
+                while (!write_marks_.empty() && write_marks_.front().frames <= settled_) {
+                    metrics_.latency.record(LatencyRecorder::WRITE, write_marks_.front().type,
+                                            now - write_marks_.front().handled);
+                    write_marks_.pop_front();
+                }
+            }
+            
+            if (ec) {
+                closed_ = true;
+                on_drained_ = nullptr;
+                write_marks_.clear();
+                release_locked(0);
+                writing_ = false;
+            }
+        }
+        
+        if (ec) {
+            SYSTEM_LOG(logger_, LogLevel::WARN, "Failed to send message to " + owner_ + ": " + ec.message());
+            return;
+        }
+        write_next();
+    }
+    
+    // Drops queued frames, keeping the first `keep` (a write in flight).
+    void release_locked(size_t keep) {
+        while (frames_.size() > keep) {
+            metrics_.outbound_frames_queued--;
+            metrics_.outbound_bytes_queued -= frames_.back()->size();
+            queued_bytes_ -= frames_.back()->size();
+            frames_.pop_back();
+        }
+    }
+};
+
+// System participant
+// availability and last_activity are read from every strand, so they are
+// atomic; the outbound queue and pending messages are guarded by mutex,
+// which the registry also holds while it changes availability.
+class Participant {
+public:
+    std::string identifier;
+    uint32_t number{0};     // compact id used by the binary event log
+    std::atomic<protocol::Availability> availability;
+    std::shared_ptr<OutboundQueue> outbound;
+    std::deque<Communication> personal_history;  // guarded by CommunicationRepository
+    uint64_t history_first_sequence{1};         // sequence of personal_history.front(), same guard
+    std::deque<VersionedFrame> mensajes_pendientes;
+    size_t pending_bytes{0};        // encoded size of mensajes_pendientes and pending_tail
+    uint64_t pending_spooled{0};    // spooled by PendingStore, written or not, all newer than mensajes_pendientes
+    uint64_t spool_readable{0};     // of those, on disk and not yet delivered
+    uint64_t spool_offset{0};       // read position of the next delivery in the spool file
+    uint64_t spool_end{0};          // bytes written to the spool file
+    uint32_t spool_generation{0};   // part of the spool file name, bumped when it is removed
+    int spool_fd{-1};               // spool file, open for appends while pending_spooled > 0
+    std::string spool_unwritten;    // records waiting for PendingStore::write_spool
+    bool spool_writing{false};      // a write_spool call is writing them
+    bool spool_awaited{false};      // a drain stopped at records not yet written
+    bool draining{false};           // a drain is reading the spool file
+    bool drain_again{false};        // and another one was asked for meanwhile
+    std::deque<VersionedFrame> pending_tail;    // newer than the spool, kept in memory after a failed append
+    size_t pending_delivered{0};    // queued so far by a drain still in progress
+    std::atomic<std::chrono::system_clock::time_point> last_activity;
+    std::atomic<bool> activity_armed{false};    // has an entry in the ActivityMonitor wheel
+    io::ip::address network_address;
+    std::mutex mutex;
+    
+    Participant(std::string id, std::shared_ptr<OutboundQueue> queue, 
+                io::ip::address addr)
+        : identifier(std::move(id)), 
+          availability(protocol::Availability::AVAILABLE), 
+          outbound(std::move(queue)),
+          last_activity(std::chrono::system_clock::now()),
+          network_address(std::move(addr)) {}
+    
+    ~Participant() {
+        if (spool_fd >= 0) {
+            ::close(spool_fd);
+        }
+    }
+    
+    std::shared_ptr<OutboundQueue> get_outbound() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return outbound;
+    }
+    
+    void set_outbound(std::shared_ptr<OutboundQueue> queue) {
+        std::lock_guard<std::mutex> lock(mutex);
+        outbound = std::move(queue);
+    }
+    
+    void set_outbound(std::shared_ptr<OutboundQueue> queue, io::ip::address addr) {
+        std::lock_guard<std::mutex> lock(mutex);
+        outbound = std::move(queue);
+        network_address = std::move(addr);
+    }
+    
+    // Queues a frame for this participant; returns false when there is no
+    // open connection or the frame did not fit its OutboundBudget.
+    bool send(SharedFrame frame) {
+        auto queue = get_outbound();
+        return queue && queue->enqueue(std::move(frame));
+    }
+    
+    // Queues the encoding that matches the connection's wire version.
+    bool send(const VersionedFrame& frame) {
+        auto queue = get_outbound();
+        return queue && queue->enqueue(frame.get(queue->version()));
+    }
+    
+    bool is_available() const {
+        return availability == protocol::Availability::AVAILABLE;
+    }
+    
+    bool can_receive_communications() const {
+        return availability != protocol::Availability::OFFLINE;
+    }
+    
+    
+    void update_last_activity() {
+        last_activity = std::chrono::system_clock::now();
+    }
+};
+
+// Protocol utilities
+class ProtocolUtils {
+public:
+    static SharedFrame freeze(std::vector<uint8_t> frame) {
+        return std::make_shared<const std::vector<uint8_t>>(std::move(frame));
+    }
+    
+    // Runs `build(version)` once per wire version.
+    template <typename Builder>
+    static VersionedFrame freeze_all(Builder&& build) {
+        return {freeze(build(protocol::WireVersion::V1)), freeze(build(protocol::WireVersion::V2))};
+    }
+    
+    static size_t max_count(protocol::WireVersion version) {
+        return version == protocol::WireVersion::V1 ? 255 : 0xFFFFFFFFu;
+    }
+    
+    static std::vector<uint8_t> create_error_response(protocol::FailureReason reason) {
+        return {protocol::ServerResponse::FAILURE, static_cast<uint8_t>(reason)};
+    }
+    
+    static std::vector<uint8_t> create_participant_list(const std::vector<std::shared_ptr<Participant>>& participants,
+                                                        protocol::WireVersion version = protocol::WireVersion::V1) {
+        size_t count = std::min(participants.size(), max_count(version));
         
-        response.insert(response.end(), participant->identifier.begin(), participant->identifier.end());
-        response.push_back(static_cast<uint8_t>(participant->availability));
+        std::vector<uint8_t> response = {protocol::ServerResponse::PARTICIPANT_LIST};
+        append_count(response, count, version);
+        
+        for (size_t i = 0; i < count; i++) {
+            const auto& participant = participants[i];
+            
+            append_string(response, participant->identifier, version);
+            response.push_back(static_cast<uint8_t>(participant->availability.load()));
+        }
         
         return response;
     }
     
-    static std::vector<uint8_t> create_availability_update(const std::string& participant_id, 
-                                                          protocol::Availability status) {
-        std::vector<uint8_t> response = {
-            protocol::ServerResponse::AVAILABILITY_UPDATE,
-            static_cast<uint8_t>(participant_id.size())
-        };
+    static std::vector<uint8_t> create_participant_details(const std::shared_ptr<Participant>& participant,
+                                                           protocol::WireVersion version = protocol::WireVersion::V1) {
+        if (!participant) {
+            return create_error_response(protocol::FailureReason::PARTICIPANT_UNKNOWN);
+        }
         
-        response.insert(response.end(), participant_id.begin(), participant_id.end());
-        response.push_back(static_cast<uint8_t>(status));
+        std::vector<uint8_t> response = {protocol::ServerResponse::PARTICIPANT_DETAILS};
+        append_string(response, participant->identifier, version);
+        response.push_back(static_cast<uint8_t>(participant->availability.load()));
         
         return response;
     }
     
-    static std::vector<uint8_t> create_new_participant_notification(const std::string& participant_id) {
-        std::vector<uint8_t> response = {
-            protocol::ServerResponse::PARTICIPANT_JOINED,
-            static_cast<uint8_t>(participant_id.size())
-        };
+    static std::vector<uint8_t> create_availability_update(const std::string& participant_id, 
+                                                          protocol::Availability status,
+                                                          protocol::WireVersion version = protocol::WireVersion::V1) {
+        std::vector<uint8_t> response = {protocol::ServerResponse::AVAILABILITY_UPDATE};
+        append_string(response, participant_id, version);
+        response.push_back(static_cast<uint8_t>(status));
         
-        response.insert(response.end(), participant_id.begin(), participant_id.end());
+        return response;
+    }
+    
+    static std::vector<uint8_t> create_new_participant_notification(const std::string& participant_id,
+                                                                    protocol::WireVersion version = protocol::WireVersion::V1) {
+        std::vector<uint8_t> response = {protocol::ServerResponse::PARTICIPANT_JOINED};
+        append_string(response, participant_id, version);
         response.push_back(static_cast<uint8_t>(protocol::Availability::AVAILABLE));
         
         return response;
     }
     
-    static std::vector<uint8_t> create_communication_message(const std::string& sender, 
-                                                           const std::string& content) {
-        std::vector<uint8_t> response = {
-            protocol::ServerResponse::COMMUNICATION,
-            static_cast<uint8_t>(sender.size())
-        };
+    // V1 truncates content to 255 bytes; V2 carries it whole.
+    static std::vector<uint8_t> create_communication_message(boost::beast::string_view sender, 
+                                                           boost::beast::string_view content,
+                                                           protocol::WireVersion version = protocol::WireVersion::V1) {
+        std::vector<uint8_t> response = {protocol::ServerResponse::COMMUNICATION};
+        append_string(response, sender, version);
+        append_string(response, content, version);
+        
+        return response;
+    }
+    
+    static std::vector<uint8_t> create_history_response(const PublicHistoryRing& history, size_t max_count,
+                                                        protocol::WireVersion version = protocol::WireVersion::V1) {
+        size_t count = std::min({history.size(), max_count, ProtocolUtils::max_count(version)});
+        
+        // Reserve an upper bound first (a 4-byte count, 5-byte varint
+        // lengths) so the encode below never reallocates.
+        size_t bytes = 1 + 4;
+        history.for_each_last(count, [&bytes](const std::string& sender, boost::beast::string_view content,
+                                              std::chrono::system_clock::time_point) {
+            bytes += 2 * 5 + sender.size() + content.size();
+        });
+        
+        std::vector<uint8_t> response;
+        response.reserve(bytes);
+        response.push_back(protocol::ServerResponse::COMMUNICATION_HISTORY);
+        append_count(response, count, version);
+        
+        history.for_each_last(count, [&response, version](const std::string& sender, boost::beast::string_view content,
+                                                          std::chrono::system_clock::time_point) {
+            append_string(response, sender, version);
+            append_string(response, content, version);
+        });
         
-        response.insert(response.end(), sender.begin(), sender.end());
+        return response;
+    }
+    
+    static std::vector<uint8_t> create_history_response(const std::vector<Communication>& history,
+                                                        protocol::WireVersion version = protocol::WireVersion::V1) {
+        size_t count = std::min(history.size(), max_count(version));
+        
+        std::vector<uint8_t> response = {protocol::ServerResponse::COMMUNICATION_HISTORY};
+        append_count(response, count, version);
+        
+        for (size_t i = 0; i < count; i++) {
+            const auto& comm = history[i];
+            append_string(response, comm.sender, version);
+            append_string(response, comm.content, version);
+        }
         
-        uint8_t content_size = static_cast<uint8_t>(std::min(content.size(), static_cast<size_t>(255)));
-        response.push_back(content_size);
+        return response;
+    }
+    
+    // [COMMUNICATION_PAGE][channel_len][channel][first:u64][count:u16][more:u8]
+    // then per entry [sender_len][sender][timestamp_ms:u64][content_len:u16][content].
+    // In V2 the channel, sender and content lengths are varints. Entries are
+    // numbered first, first + 1, ...; with more set the client asks for the
+    // next page with first as its cursor.
+    static std::vector<uint8_t> create_page_header(boost::beast::string_view channel, protocol::WireVersion version) {
+        std::vector<uint8_t> response = {protocol::ServerResponse::COMMUNICATION_PAGE};
+        append_string(response, channel, version);
+        response.resize(response.size() + 8 + 2 + 1);
+        return response;
+    }
+    
+    static void append_page_entry(std::vector<uint8_t>& out, const std::string& sender, 
+                                  boost::beast::string_view content,
+                                  std::chrono::system_clock::time_point timestamp,
+                                  protocol::WireVersion version) {
+        append_string(out, sender, version);
+        append_u64(out, static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(timestamp.time_since_epoch()).count()));
         
-        auto content_begin = content.begin();
-        auto content_end = content_size < content.size() ? content_begin + content_size : content.end();
+        if (version == protocol::WireVersion::V2) {
+            append_string(out, content, version);
+            return;
+        }
+        // Only journal records written before MAX_CONTENT_LENGTH can be longer.
+        static_assert(protocol::MAX_CONTENT_LENGTH <= 0xFFFF, "v1 page entries carry a u16 content length");
+        size_t content_size = std::min(content.size(), static_cast<size_t>(0xFFFF));
+        out.push_back(static_cast<uint8_t>(content_size >> 8));
+        out.push_back(static_cast<uint8_t>(content_size));
+        out.insert(out.end(), content.begin(), content.begin() + content_size);
+    }
+    
+    // Fills in the header fields that create_page_header left blank.
+    static void finish_page(std::vector<uint8_t>& page, size_t header_size, 
+                            uint64_t first, size_t count, bool more) {
+        uint8_t* header = page.data() + header_size - 11;
+        for (int i = 0; i < 8; i++) {
+            header[i] = static_cast<uint8_t>(first >> (56 - 8 * i));
+        }
+        header[8] = static_cast<uint8_t>(count >> 8);
+        header[9] = static_cast<uint8_t>(count);
+        header[10] = more ? 1 : 0;
+    }
+    
+    // [PRESENCE_DELTA][full][version:u64][count:u32] then per entry
+    // [id_len][id][status]. With full set, the entries replace the client's
+    // whole list; otherwise they apply on top of the version it sent.
+    static std::vector<uint8_t> create_presence_delta(bool full, uint64_t version, 
+                                                     const std::vector<PresenceChange>& changes,
+                                                     protocol::WireVersion wire_version = protocol::WireVersion::V1) {
+        std::vector<uint8_t> response = {
+            protocol::ServerResponse::PRESENCE_DELTA,
+            static_cast<uint8_t>(full ? 1 : 0)
+        };
+        
+        append_u64(response, version);
+        append_u32(response, static_cast<uint32_t>(changes.size()));
+        
+        for (const auto& change : changes) {
+            append_string(response, change.identifier, wire_version);
+            response.push_back(static_cast<uint8_t>(change.availability));
+        }
+        
+        return response;
+    }
+    
+    // One byte in V1 (callers clamp to 255 first), LEB128 varint in V2.
+    static void append_length(std::vector<uint8_t>& out, size_t length, protocol::WireVersion version) {
+        if (version == protocol::WireVersion::V1) {
+            out.push_back(static_cast<uint8_t>(length));
+            return;
+        }
+        while (length >= 0x80) {
+            out.push_back(static_cast<uint8_t>(length | 0x80));
+            length >>= 7;
+        }
+        out.push_back(static_cast<uint8_t>(length));
+    }
+    
+    static void append_count(std::vector<uint8_t>& out, size_t count, protocol::WireVersion version) {
+        if (version == protocol::WireVersion::V1) {
+            out.push_back(static_cast<uint8_t>(count));
+        } else {
+            append_u32(out, static_cast<uint32_t>(count));
+        }
+    }
+    
+    // Length-prefixed bytes; V1 keeps at most the first 255.
+    static void append_string(std::vector<uint8_t>& out, boost::beast::string_view value, 
+                              protocol::WireVersion version) {
+        size_t length = version == protocol::WireVersion::V1 ? std::min(value.size(), static_cast<size_t>(255)) 
+                                                             : value.size();
+        append_length(out, length, version);
+        out.insert(out.end(), value.begin(), value.begin() + length);
+    }
+    
+    static void append_u32(std::vector<uint8_t>& out, uint32_t value) {
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            out.push_back(static_cast<uint8_t>(value >> shift));
+        }
+    }
+    
+    static void append_u64(std::vector<uint8_t>& out, uint64_t value) {
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            out.push_back(static_cast<uint8_t>(value >> shift));
+        }
+    }
+    
+    static uint64_t read_u64(const uint8_t* data) {
+        uint64_t value = 0;
+        for (int i = 0; i < 8; i++) {
+            value = (value << 8) | data[i];
+        }
+        return value;
+    }
+    
+    static std::string parse_query_parameter(const std::string& query_string, const std::string& param_name) {
+        std::string value;
+        
+        size_t pos = query_string.find(param_name + "=");
+        if (pos != std::string::npos) {
+            value = query_string.substr(pos + param_name.size() + 1);
+            
+            pos = value.find('&');
+            if (pos != std::string::npos) {
+                value = value.substr(0, pos);
+            }
+            
+            boost::replace_all(value, "%20", " ");
+        }
+        
+        return value;
+    }
+};
+
+// Bounds-checked cursor over one request frame, read in place from the
+// connection's buffer (the load generator and benchmarks also use it on
+// server frames). Strings come back as views into the frame; a read
+// past the end returns an empty value and leaves ok() false for good, so a
+// handler can read every field and check once.
+class RequestReader {
+private:
+    const uint8_t* data_;
+    size_t size_;
+    size_t offset_{0};
+    protocol::WireVersion version_;
+    bool ok_{true};
+    std::chrono::steady_clock::time_point parsed_at_{};
+
+public:
+    RequestReader(const uint8_t* data, size_t size, protocol::WireVersion version)
+        : data_(data), size_(size), version_(version) {}
+    
+    protocol::WireVersion version() const {
+        return version_;
+    }
+    
+    // Handlers call this once every field has been read; latency up to
+    // here counts as parsing, the rest as handling.
+    void mark_parsed() {
+        parsed_at_ = std::chrono::steady_clock::now();
+    }
+    
+    // Epoch if the handler never called mark_parsed().
+    std::chrono::steady_clock::time_point parsed_at() const {
+        return parsed_at_;
+    }
+    
+    bool ok() const {
+        return ok_;
+    }
+    
+    size_t size() const {
+        return size_;
+    }
+    
+    uint8_t u8() {
+        if (!take(1)) {
+            return 0;
+        }
+        return data_[offset_ - 1];
+    }
+    
+    uint16_t u16() {
+        if (!take(2)) {
+            return 0;
+        }
+        return static_cast<uint16_t>((data_[offset_ - 2] << 8) | data_[offset_ - 1]);
+    }
+    
+    uint32_t u32() {
+        if (!take(4)) {
+            return 0;
+        }
+        const uint8_t* in = data_ + offset_ - 4;
+        return (static_cast<uint32_t>(in[0]) << 24) | (static_cast<uint32_t>(in[1]) << 16) |
+               (static_cast<uint32_t>(in[2]) << 8) | in[3];
+    }
+    
+    uint64_t u64() {
+        if (!take(8)) {
+            return 0;
+        }
+        return ProtocolUtils::read_u64(data_ + offset_ - 8);
+    }
+    
+    // LEB128, at most 32 bits.
+    uint32_t varint() {
+        uint32_t value = 0;
+        for (int shift = 0; ok_; shift += 7) {
+            uint8_t byte = u8();
+            if (shift > 28) {
+                ok_ = false;
+                break;
+            }
+            value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) {
+                break;
+            }
+        }
+        return ok_ ? value : 0;
+    }
+    
+    // One-byte length in V1, varint (at most 32 bits) in V2.
+    boost::beast::string_view string() {
+        size_t length = version_ == protocol::WireVersion::V1 ? u8() : varint();
+        return bytes(length);
+    }
+    
+    boost::beast::string_view bytes(size_t length) {
+        if (!take(length)) {
+            return {};
+        }
+        return boost::beast::string_view(reinterpret_cast<const char*>(data_ + offset_ - length), length);
+    }
+
+private:
+    bool take(size_t count) {
+        if (!ok_ || count > size_ - offset_) {
+            ok_ = false;
+            return false;
+        }
+        offset_ += count;
+        return true;
+    }
+};
+
+// Bounded log of recent presence transitions, kept beside the registry so
+// reconnecting clients can catch up from the last version they saw.
+class PresenceLog {
+public:
+    static constexpr size_t CAPACITY = 4096;
+
+private:
+    mutable std::mutex mutex_;
+    std::deque<PresenceChange> changes_;
+    std::atomic<uint64_t> version_{0};
+
+public:
+    uint64_t version() const {
+        return version_.load();
+    }
+    
+    uint64_t record(const std::string& identifier, protocol::Availability availability) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        uint64_t version = version_.load() + 1;
+        changes_.push_back({version, identifier, availability});
+        if (changes_.size() > CAPACITY) {
+            changes_.pop_front();
+        }
+        version_.store(version);
+        return version;
+    }
+    
+    // Latest status per participant changed after `since`, in change order.
+    // Returns false if the log no longer reaches back that far.
+    bool changes_since(uint64_t since, std::vector<PresenceChange>& out, uint64_t& current) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        current = version_.load();
+        
+        if (since > current) {
+            return false;
+        }
+        if (since == current) {
+            return true;
+        }
+        if (changes_.empty() || changes_.front().version > since + 1) {
+            return false;
+        }
+        
+        // Walk newest to oldest so only each participant's last change is kept.
+        std::unordered_set<std::string> seen;
+        auto last = changes_.rbegin() + static_cast<std::ptrdiff_t>(current - since);
+        for (auto it = changes_.rbegin(); it != last; ++it) {
+            if (seen.insert(it->identifier).second) {
+                out.push_back(*it);
+            }
+        }
+        std::reverse(out.begin(), out.end());
+        return true;
+    }
+};
+
+// Online participants as published by the registry; never modified once shared
+using ParticipantSnapshot = std::shared_ptr<const std::vector<std::shared_ptr<Participant>>>;
+
+// Store-and-forward for private messages to BUSY and OFFLINE participants.
+// Each participant holds up to memory_limit bytes of encoded frames in
+// mensajes_pendientes; past that, messages are appended to its spool file
+//   [sender_len:u16][sender][content_len:u32][content]   (little-endian)
+// and encoded for the connection's wire version when delivered. Once a
+// participant has spilled, newer messages follow to disk, so the backlog
+// is always delivered in arrival order. If an append fails after that,
+// the message and every newer one wait in pending_tail, which is only
+// delivered once the spool file is empty. Spool files are scratch space
+// and are cleared at startup; the journal keeps the durable copy.
+//
+// The participant's lock only guards the bookkeeping: senders add records
+// to spool_unwritten under it, and the file is written (write_spool) and
+// read (drain) without it, so a slow disk never stalls other senders or
+// the participant's status changes.
+class PendingStore {
+public:
+    static constexpr size_t DEFAULT_MEMORY_LIMIT = 64 * 1024;
+
+private:
+    std::filesystem::path directory_;   // empty: everything stays in memory
+    size_t memory_limit_{DEFAULT_MEMORY_LIMIT};
+    std::atomic<uint64_t> memory_bytes_{0};
+    std::atomic<uint64_t> spooled_{0};
+    std::atomic<uint64_t> delivered_{0};
+    SystemLogger& logger_;
+
+public:
+    explicit PendingStore(SystemLogger& logger) : logger_(logger) {}
+    
+    // Enables spilling to `directory`; an empty one keeps everything in
+    // memory. If the directory cannot be set up, logs why and stays
+    // memory-only. Must be called before the server starts accepting
+    // connections.
+    bool configure(const std::string& directory, size_t memory_limit) {
+        memory_limit_ = memory_limit;
+        directory_.clear();
+        if (directory.empty()) {
+            return true;
+        }
+        
+        try {
+            std::filesystem::create_directories(directory);
+            for (const auto& file : std::filesystem::directory_iterator(directory)) {
+                if (file.path().extension() == ".q") {
+                    std::filesystem::remove(file.path());
+                }
+            }
+        } catch (const std::filesystem::filesystem_error& e) {
+            SYSTEM_LOG(logger_, LogLevel::WARN, "No se puede usar " + directory + " para mensajes pendientes (" + e.what() + 
+                       "); se guardan solo en memoria");
+            return false;
+        }
+        directory_ = directory;
+        return true;
+    }
+    
+    uint64_t memory_bytes() const {
+        return memory_bytes_.load(std::memory_order_relaxed);
+    }
+    
+    uint64_t spooled() const {
+        return spooled_.load(std::memory_order_relaxed);
+    }
+    
+    uint64_t delivered() const {
+        return delivered_.load(std::memory_order_relaxed);
+    }
+    
+    enum class Outcome {
+        QUEUED,     // on the participant's outbound queue
+        HELD,       // kept until the next drain
+        REFUSED     // the outbound queue turned it down
+    };
+    
+    // Queues a private message right away if the participant is AVAILABLE
+    // or AWAY, connected, and has nothing older held; otherwise it joins
+    // the end of the backlog, so it cannot overtake it. Availability and
+    // the connection are read under the participant's lock, the same one
+    // drain() takes: a participant that becomes deliverable after this
+    // check drains after it too, so a held message is never stranded.
+    // A message held for the spool is only buffered; call write_spool
+    // afterwards.
+    Outcome deliver_or_hold(Participant& participant, const VersionedFrame& frame,
+                            boost::beast::string_view sender, boost::beast::string_view content) {
+        std::lock_guard<std::mutex> lock(participant.mutex);
+        auto status = participant.availability.load();
+        bool deliverable = participant.outbound && 
+                           (status == protocol::Availability::AVAILABLE || status == protocol::Availability::AWAY);
+        if (deliverable && participant.mensajes_pendientes.empty() && participant.pending_spooled == 0) {
+            auto& queue = *participant.outbound;
+            return queue.enqueue(frame.get(queue.version())) ? Outcome::QUEUED : Outcome::REFUSED;
+        }
+        hold_locked(participant, frame, sender, content);
+        return Outcome::HELD;
+    }
+    
+    // Appends the records buffered by deliver_or_hold to the spool file.
+    // One thread per participant writes at a time; senders that buffer
+    // records meanwhile return at once and the writer picks them up too.
+    // Returns true if a drain stopped to wait for what was written, in
+    // which case the caller should drain again.
+    bool write_spool(Participant& participant) {
+        std::unique_lock<std::mutex> lock(participant.mutex);
+        if (participant.spool_writing) {
+            return false;
+        }
+        participant.spool_writing = true;
+        
+        bool wake = false;
+        std::filesystem::path stale;
+        while (!participant.spool_unwritten.empty()) {
+            std::string batch = std::move(participant.spool_unwritten);
+            participant.spool_unwritten.clear();
+            int fd = participant.spool_fd;
+            auto path = spool_path(participant);
+            lock.unlock();
+            
+            // drain() cannot close the file meanwhile: the batch is still
+            // counted in pending_spooled.
+            if (fd < 0) {
+                fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            }
+            ssize_t written = fd >= 0 ? ::write(fd, batch.data(), batch.size()) : -1;
+            std::string error = written < 0 ? std::strerror(errno) : "escritura incompleta";
+            
+            lock.lock();
+            participant.spool_fd = fd;
+            if (written == static_cast<ssize_t>(batch.size())) {
+                participant.spool_end += batch.size();
+                participant.spool_readable += count_records(batch);
+            } else {
+                // A short write leaves a partial record past spool_end,
+                // which read_spool never reaches.
+                SYSTEM_LOG(logger_, LogLevel::WARN, "No se pudo escribir en " + path.string() + ": " + error + 
+                           "; los mensajes quedan en memoria");
+                batch += participant.spool_unwritten;
+                participant.spool_unwritten.clear();
+                keep_in_memory_locked(participant, batch);
+                if (participant.pending_spooled == 0) {
+                    stale = close_spool_locked(participant);
+                }
+            }
+            wake = std::exchange(participant.spool_awaited, false) || wake;
+        }
+        participant.spool_writing = false;
+        lock.unlock();
+        
+        remove_spool(stale);
+        return wake;
+    }
+    
+    struct Drained {
+        size_t queued{0};       // by this call
+        size_t total{0};        // by the whole drain, set when it finishes
+        bool more{false};
+        bool retry{false};      // another drain was asked for while this one read the spool
+    };
+    
+    // Moves the oldest held messages, up to max_frames or max_bytes, to
+    // `queue` in one bulk enqueue, so the backlog goes out in arrival
+    // order. Availability is checked under the participant's lock, where
+    // it is changed, so nothing is queued once the participant is BUSY or
+    // OFFLINE or `queue` is no longer its connection; the transition that
+    // makes it reachable again drains the rest. The spool is read without
+    // the lock and availability is checked again before enqueueing.
+    Drained drain(Participant& participant, OutboundQueue& queue, size_t max_frames, size_t max_bytes) {
+        std::unique_lock<std::mutex> lock(participant.mutex);
+        auto& held = participant.mensajes_pendientes;
+        Drained result;
+        
+        if (participant.draining) {
+            participant.drain_again = true;
+            return result;
+        }
+        if (!reachable_locked(participant, queue)) {
+            return result;
+        }
+        
+        std::vector<SharedFrame> run;
+        size_t bytes = 0;
+        for (size_t i = 0; i < held.size() && run.size() < max_frames && bytes < max_bytes; i++) {
+            run.push_back(held[i].get(queue.version()));
+            bytes += run.back()->size();
+        }
+        size_t from_memory = run.size();
+        
+        uint64_t offset = participant.spool_offset;
+        bool intact = true;
+        if (from_memory == held.size() && participant.spool_readable > 0) {
+            // Meanwhile senders only add to the spool and `draining` keeps
+            // other drains out, so the front of the backlog stays put.
+            auto path = spool_path(participant);
+            uint64_t readable = participant.spool_readable;
+            participant.draining = true;
+            lock.unlock();
+            intact = read_spool(path, readable, queue.version(), max_frames, max_bytes, run, bytes, offset);
+            lock.lock();
+            participant.draining = false;
+            result.retry = std::exchange(participant.drain_again, false);
+            if (!reachable_locked(participant, queue)) {
+                return result;
+            }
+        }
+        size_t from_spool = run.size() - from_memory;
+        
+        if (!run.empty() && !queue.enqueue_bulk(run)) {
+            result.more = true;
+            return result;
+        }
+        
+        for (size_t i = 0; i < from_memory; i++) {
+            size_t size = held.front().v1->size() + held.front().v2->size();
+            participant.pending_bytes -= size;
+            memory_bytes_ -= size;
+            held.pop_front();
+        }
+        participant.spool_offset = offset;
+        participant.spool_readable -= from_spool;
+        participant.pending_spooled -= from_spool;
+        spooled_ -= from_spool;
+        
+        if (!intact) {
+            SYSTEM_LOG(logger_, LogLevel::WARN, "Archivo de pendientes dañado: " + spool_path(participant).string() + 
+                       ", se descartan " + std::to_string(participant.spool_readable) + " mensajes");
+            participant.pending_spooled -= participant.spool_readable;
+            spooled_ -= participant.spool_readable;
+            participant.spool_readable = 0;
+            participant.spool_offset = participant.spool_end;
+        }
+        std::filesystem::path stale;
+        if ((from_spool > 0 || !intact) && participant.pending_spooled == 0) {
+            stale = close_spool_locked(participant);
+            // Everything older than the tail is out, so it is next in line.
+            std::move(participant.pending_tail.begin(), participant.pending_tail.end(), std::back_inserter(held));
+            participant.pending_tail.clear();
+        }
+        
+        result.queued = run.size();
+        delivered_ += run.size();
+        participant.pending_delivered += run.size();
+        result.more = !held.empty() || participant.spool_readable > 0;
+        // Records still being written: write_spool reports it once they are on disk.
+        participant.spool_awaited = !result.more && participant.pending_spooled > 0;
+        if (!result.more && !participant.spool_awaited) {
+            result.total = std::exchange(participant.pending_delivered, 0);
+        }
+        lock.unlock();
+        
+        remove_spool(stale);
+        return result;
+    }
+
+private:
+    // Each spool file gets a new generation, so removing a drained one
+    // outside the lock never hits the file a later spill is writing.
+    std::filesystem::path spool_path(const Participant& participant) const {
+        return directory_ / (std::to_string(participant.number) + "-" + std::to_string(participant.spool_generation) + ".q");
+    }
+    
+    static bool reachable_locked(const Participant& participant, const OutboundQueue& queue) {
+        auto status = participant.availability.load();
+        return participant.outbound.get() == &queue && 
+               status != protocol::Availability::BUSY && status != protocol::Availability::OFFLINE;
+    }
+    
+    static void encode_record(std::string& records, boost::beast::string_view sender, boost::beast::string_view content) {
+        size_t at = records.size();
+        records.resize(at + 2 + sender.size() + 4 + content.size());
+        char* out = &records[at];
+        put(out, sender.size(), 2);
+        std::memcpy(out + 2, sender.data(), sender.size());
+        out += 2 + sender.size();
+        put(out, content.size(), 4);
+        std::memcpy(out + 4, content.data(), content.size());
+    }
+    
+    // Decodes the record at `at` in a buffer built by encode_record and
+    // returns the offset of the next one.
+    static size_t decode_record(const std::string& records, size_t at, 
+                                boost::beast::string_view& sender, boost::beast::string_view& content) {
+        auto in = reinterpret_cast<const uint8_t*>(records.data()) + at;
+        size_t sender_size = get(in, 2);
+        sender = boost::beast::string_view(records.data() + at + 2, sender_size);
+        size_t content_size = get(in + 2 + sender_size, 4);
+        content = boost::beast::string_view(records.data() + at + 2 + sender_size + 4, content_size);
+        return at + 2 + sender_size + 4 + content_size;
+    }
+    
+    static uint64_t count_records(const std::string& records) {
+        uint64_t count = 0;
+        boost::beast::string_view sender, content;
+        for (size_t at = 0; at < records.size(); count++) {
+            at = decode_record(records, at, sender, content);
+        }
+        return count;
+    }
+    
+    // Takes back records whose write failed. They are the newest spooled
+    // ones, so they start pending_tail; once nothing is left on disk they
+    // are next in line.
+    void keep_in_memory_locked(Participant& participant, const std::string& records) {
+        boost::beast::string_view sender, content;
+        for (size_t at = 0; at < records.size();) {
+            at = decode_record(records, at, sender, content);
+            auto frame = ProtocolUtils::freeze_all([sender, content](protocol::WireVersion version) {
+                return ProtocolUtils::create_communication_message(sender, content, version);
+            });
+            size_t size = frame.v1->size() + frame.v2->size();
+            participant.pending_bytes += size;
+            memory_bytes_ += size;
+            participant.pending_tail.push_back(std::move(frame));
+            participant.pending_spooled--;
+            spooled_--;
+        }
+        if (participant.pending_spooled == 0) {
+            std::move(participant.pending_tail.begin(), participant.pending_tail.end(), 
+                      std::back_inserter(participant.mensajes_pendientes));
+            participant.pending_tail.clear();
+        }
+    }
+    
+    // Returns the file to remove once the lock is released.
+    std::filesystem::path close_spool_locked(Participant& participant) {
+        auto path = spool_path(participant);
+        if (participant.spool_fd >= 0) {
+            ::close(participant.spool_fd);
+            participant.spool_fd = -1;
+        }
+        participant.spool_offset = 0;
+        participant.spool_end = 0;
+        participant.spool_generation++;
+        return path;
+    }
+    
+    static void remove_spool(const std::filesystem::path& path) {
+        if (!path.empty()) {
+            std::error_code ignored;
+            std::filesystem::remove(path, ignored);
+        }
+    }
+    
+    void hold_locked(Participant& participant, VersionedFrame frame, 
+                     boost::beast::string_view sender, boost::beast::string_view content) {
+        size_t size = frame.v1->size() + frame.v2->size();
+        bool spilled = participant.pending_spooled > 0;
+        if (!directory_.empty() && participant.pending_tail.empty() &&
+            (spilled || participant.pending_bytes + size > memory_limit_)) {
+            encode_record(participant.spool_unwritten, sender, content);
+            participant.pending_spooled++;
+            spooled_++;
+            return;
+        }
+        
+        participant.pending_bytes += size;
+        memory_bytes_ += size;
+        // After a spill, anything not on disk must wait behind what is.
+        auto& held = spilled ? participant.pending_tail : participant.mensajes_pendientes;
+        held.push_back(std::move(frame));
+    }
+    
+    // Appends up to `records` records from the spool file at `path`,
+    // starting at `offset`, to `run`. Returns false if the file ends
+    // before them.
+    static bool read_spool(const std::filesystem::path& path, uint64_t records, protocol::WireVersion version, 
+                           size_t max_frames, size_t max_bytes, std::vector<SharedFrame>& run, size_t& bytes, uint64_t& offset) {
+        std::ifstream in(path, std::ios::binary);
+        in.seekg(static_cast<std::streamoff>(offset));
+        
+        std::string sender;
+        std::string content;
+        for (uint64_t left = records; left > 0 && run.size() < max_frames && bytes < max_bytes; left--) {
+            uint8_t length[4];
+            if (!in.read(reinterpret_cast<char*>(length), 2)) {
+                return false;
+            }
+            sender.resize(get(length, 2));
+            if (!in.read(&sender[0], static_cast<std::streamsize>(sender.size())) ||
+                !in.read(reinterpret_cast<char*>(length), 4)) {
+                return false;
+            }
+            content.resize(get(length, 4));
+            if (!in.read(&content[0], static_cast<std::streamsize>(content.size()))) {
+                return false;
+            }
+            
+            run.push_back(ProtocolUtils::freeze(ProtocolUtils::create_communication_message(sender, content, version)));
+            bytes += run.back()->size();
+            offset = static_cast<uint64_t>(in.tellg());
+        }
+        return true;
+    }
+    
+    static void put(char* out, uint64_t value, int bytes) {
+        for (int i = 0; i < bytes; i++) {
+            out[i] = static_cast<char>(value >> (8 * i));
+        }
+    }
+    
+    static uint64_t get(const uint8_t* in, int bytes) {
+        uint64_t value = 0;
+        for (int i = 0; i < bytes; i++) {
+            value |= static_cast<uint64_t>(in[i]) << (8 * i);
+        }
+        return value;
+    }
+};
+
+// Registry of all participants
+// Lookups are striped over SHARD_COUNT independently locked maps. The set of
+// online participants is also published as an immutable snapshot that
+// readers load without taking any registry lock.
+class ParticipantRegistry {
+public:
+    static constexpr size_t SHARD_COUNT = 16;
+
+private:
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, std::shared_ptr<Participant>> participants;
+    };
+    
+    // Encoded PARTICIPANT_LIST and the registry version it was built from
+    struct ListCache {
+        uint64_t version;
+        VersionedFrame frame;
+    };
+    
+    std::array<Shard, SHARD_COUNT> shards_;
+    ParticipantSnapshot online_;        // accessed with std::atomic_load/store
+    std::mutex snapshot_mutex_;         // serializes snapshot writers
+    std::mutex transition_mutex_;       // orders availability changes with their presence_log_ entries
+    PresenceLog presence_log_;          // its version is bumped after every visible presence change
+    std::shared_ptr<const ListCache> list_cache_;  // accessed with std::atomic_load/store
+    std::atomic<uint32_t> next_number_{1};
+    std::function<void(const std::shared_ptr<Participant>&)> available_listener_;
+    PendingStore pending_;
+    FanoutHistogram fanout_;
+    SystemLogger& logger_;
+
+public:
+    explicit ParticipantRegistry(SystemLogger& logger) 
+        : online_(std::make_shared<const std::vector<std::shared_ptr<Participant>>>()), 
+          pending_(logger),
+          logger_(logger) {}
+    
+    PendingStore& pending() {
+        return pending_;
+    }
+    
+    const FanoutHistogram& fanout() const {
+        return fanout_;
+    }
+    
+    bool register_participant(const std::string& id, 
+                              std::shared_ptr<OutboundQueue> conn,
+                              io::ip::address addr) {
+        std::shared_ptr<Participant> participant;
+        {
+            std::lock_guard<std::mutex> transition(transition_mutex_);
+            {
+                auto& shard = shard_for(id);
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                
+                auto it = shard.participants.find(id);
+                if (it != shard.participants.end()) {
+                    if (it->second->availability != protocol::Availability::OFFLINE) {
+                        return false;
+                    }
+                    
+                    it->second->set_outbound(conn, addr);
+                    it->second->availability = protocol::Availability::AVAILABLE;
+                    it->second->update_last_activity();
+                    participant = it->second;
+                } else {
+                    participant = std::make_shared<Participant>(id, conn, addr);
+                    participant->number = next_number_++;
+                    shard.participants[id] = participant;
+                    logger_.event_name(participant->number, id);
+                }
+            }
+            
+            refresh_snapshot(participant);
+            presence_log_.record(id, protocol::Availability::AVAILABLE);
+        }
+        notify_available(participant);
+        return true;
+    }
+    
+    // Called whenever a participant becomes AVAILABLE. Must be set before
+    // the server starts accepting connections.
+    void set_available_listener(std::function<void(const std::shared_ptr<Participant>&)> listener) {
+        available_listener_ = std::move(listener);
+    }
+    
+    // Creates an OFFLINE participant for history replayed at startup, so a
+    // returning user reconnects into its restored personal_history.
+    std::shared_ptr<Participant> restore_participant(const std::string& id) {
+        auto& shard = shard_for(id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        auto& participant = shard.participants[id];
+        if (!participant) {
+            participant = std::make_shared<Participant>(id, nullptr, io::ip::address());
+            participant->availability = protocol::Availability::OFFLINE;
+            participant->number = next_number_++;
+            logger_.event_name(participant->number, id);
+        }
+        return participant;
+    }
+
+    std::shared_ptr<Participant> get_participant(const std::string& id) {
+        auto& shard = shard_for(id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.participants.find(id);
+        if (it != shard.participants.end()) {
+            return it->second;
+        }
+        return nullptr;
+    }
+    
+    // Lookup by a view into a request frame. The key is copied into a
+    // per-thread buffer that keeps its capacity, so this does not allocate.
+    std::shared_ptr<Participant> get_participant(boost::beast::string_view id) {
+        thread_local std::string key;
+        key.assign(id.data(), id.size());
+        return get_participant(key);
+    }
+    
+    bool set_availability(const std::string& id, protocol::Availability status) {
+        auto participant = get_participant(id);
+        if (!participant) {
+            return false;
+        }
+        
+        protocol::Availability previous;
+        {
+            std::lock_guard<std::mutex> transition(transition_mutex_);
+            {
+                // Under the participant's lock too, so PendingStore sees
+                // either the old status or the new one for a whole chunk.
+                std::lock_guard<std::mutex> lock(participant->mutex);
+                previous = participant->availability.exchange(status);
+            }
+            log_transition(participant, previous, status);
+        }
+        participant->update_last_activity();
+        applied_transition(participant, status);
+        return true;
+    }
+    
+    // Changes availability only if it is still `expected`.
+    bool set_availability_if(const std::shared_ptr<Participant>& participant, 
+                             protocol::Availability expected, protocol::Availability status) {
+        {
+            std::lock_guard<std::mutex> transition(transition_mutex_);
+            {
+                std::lock_guard<std::mutex> lock(participant->mutex);
+                if (!participant->availability.compare_exchange_strong(expected, status)) {
+                    return false;
+                }
+            }
+            log_transition(participant, expected, status);
+        }
+        applied_transition(participant, status);
+        return true;
+    }
+    
+    uint64_t version() const {
+        return presence_log_.version();
+    }
+    
+    // Encoded list of online participants, rebuilt only when the registry
+    // version has moved since the cached copy was made.
+    VersionedFrame participant_list_frame() {
+        uint64_t current = presence_log_.version();
+        auto cached = std::atomic_load(&list_cache_);
+        if (cached && cached->version == current) {
+            return cached->frame;
+        }
+        
+        auto participants = get_all_participants();
+        auto frame = ProtocolUtils::freeze_all([&participants](protocol::WireVersion version) {
+            return ProtocolUtils::create_participant_list(*participants, version);
+        });
+        std::atomic_store(&list_cache_, std::shared_ptr<const ListCache>(
+            std::make_shared<const ListCache>(ListCache{current, frame})));
+        return frame;
+    }
+    
+    // Presence changes since `since`, or a full snapshot when the client is
+    // too far behind (or ahead, e.g. after a server restart).
+    SharedFrame presence_since(uint64_t since, protocol::WireVersion wire_version) {
+        std::vector<PresenceChange> changes;
+        uint64_t current = 0;
+        if (since != 0 && presence_log_.changes_since(since, changes, current)) {
+            return ProtocolUtils::freeze(ProtocolUtils::create_presence_delta(false, current, changes, wire_version));
+        }
+        
+        changes.clear();
+        current = presence_log_.version();
+        for (const auto& participant : *get_all_participants()) {
+            changes.push_back({current, participant->identifier, participant->availability.load()});
+        }
+        return ProtocolUtils::freeze(ProtocolUtils::create_presence_delta(true, current, changes, wire_version));
+    }
+    
+    // Lock-free: returns the current snapshot of online participants.
+    ParticipantSnapshot get_all_participants() const {
+        return std::atomic_load(&online_);
+    }
+    
+    // Only enqueues; no registry lock is held while queues are touched.
+    // Returns how many participants the frame was queued for.
+    size_t broadcast(const VersionedFrame& message) {
+        auto participants = get_all_participants();
+        size_t queued = 0;
+        for (const auto& participant : *participants) {
+            if (participant->send(message)) {
+                queued++;
+            } else {
+                SYSTEM_LOG(logger_, LogLevel::DEBUG, "Omitido " + participant->identifier + " (sin conexión o cola llena)");
+            }
+        }
+        fanout_.record(queued);
+        return queued;
+    }
+    
+    bool deliver(const std::shared_ptr<Participant>& participant, SharedFrame message) {
+        return participant->send(std::move(message));
+    }
+    
+    bool deliver(const std::shared_ptr<Participant>& participant, const VersionedFrame& message) {
+        return participant->send(message);
+    }
+    
+    // Completes a (re)connection once its WebSocket is open and hands the
+    // participant whatever was held for it while it was away.
+    void update_connection(const std::string& id, std::shared_ptr<OutboundQueue> connection) {
+        auto participant = get_participant(id);
+        if (participant) {
+            participant->set_outbound(std::move(connection));
+            set_availability(id, protocol::Availability::AVAILABLE);
+        }
+    }
+    
+    // Sends held messages a chunk at a time, each chunk as one bulk
+    // enqueue: the next chunk is read once the connection has written this
+    // one, so a long backlog never exceeds the outbound budget. Nothing is
+    // sent while BUSY or OFFLINE (drain() checks before every chunk).
+    // Returns the number queued by this call.
+    size_t deliver_pending(const std::shared_ptr<Participant>& participant) {
+        auto queue = participant->get_outbound();
+        if (!queue) {
+            return 0;
+        }
+        
+        auto drained = pending_.drain(*participant, *queue, std::max<size_t>(1, queue->budget().max_frames / 4),
+                                      std::max<size_t>(1, queue->budget().max_bytes / 4));
+        if (drained.retry) {
+            return drained.queued + deliver_pending(participant);
+        }
+        if (drained.total > 0) {
+            SYSTEM_LOG(logger_, LogLevel::INFO, std::to_string(drained.total) + " mensajes pendientes entregados a " + participant->identifier);
+        }
+        if (drained.more) {
+            std::weak_ptr<Participant> weak = participant;
+            queue->when_drained([this, weak]() {
+                if (auto participant = weak.lock()) {
+                    deliver_pending(participant);
+                }
+            });
+        }
+        return drained.queued;
+    }
+    
+    // Private message to a known participant. It is held while the
+    // participant is BUSY or OFFLINE, behind any backlog still being
+    // delivered, and until the WebSocket handshake has finished.
+    PendingStore::Outcome deliver_or_hold(const std::shared_ptr<Participant>& participant, const VersionedFrame& message,
+                                          boost::beast::string_view sender, boost::beast::string_view content) {
+        auto outcome = pending_.deliver_or_hold(*participant, message, sender, content);
+        if (outcome == PendingStore::Outcome::HELD && pending_.write_spool(*participant)) {
+            deliver_pending(participant);
+        }
+        return outcome;
+    }
+
+private:
+    // Publishes a change just made under transition_mutex_, while still
+    // holding it, so presence_log_ lists concurrent changes in the order
+    // they were applied.
+    void log_transition(const std::shared_ptr<Participant>& participant,
+                        protocol::Availability previous, protocol::Availability status) {
+        if ((previous == protocol::Availability::OFFLINE) != (status == protocol::Availability::OFFLINE)) {
+            refresh_snapshot(participant);
+        }
+        if (previous != status) {
+            presence_log_.record(participant->identifier, status);
+            logger_.event(events::AVAILABILITY_CHANGED, participant->number, 0, 0, status);
+        }
+    }
+    
+    void applied_transition(const std::shared_ptr<Participant>& participant, protocol::Availability status) {
+        if (status == protocol::Availability::AVAILABLE) {
+            notify_available(participant);
+        }
+        // Whatever path made the participant reachable again (status
+        // request, sending a message, reconnecting), the backlog follows.
+        if (status == protocol::Availability::AVAILABLE || status == protocol::Availability::AWAY) {
+            deliver_pending(participant);
+        }
+    }
+    
+    void notify_available(const std::shared_ptr<Participant>& participant) {
+        if (available_listener_) {
+            available_listener_(participant);
+        }
+    }
+    
+    Shard& shard_for(const std::string& id) {
+        return shards_[std::hash<std::string>{}(id) % SHARD_COUNT];
+    }
+    
+    // Copy-on-write update of the online snapshot. It re-reads the
+    // participant's availability under snapshot_mutex_, so racing joins and
+    // leaves converge on the participant's final state.
+    void refresh_snapshot(const std::shared_ptr<Participant>& participant) {
+        std::lock_guard<std::mutex> lock(snapshot_mutex_);
+        
+        auto current = std::atomic_load(&online_);
+        bool online = participant->availability != protocol::Availability::OFFLINE;
+        bool listed = std::find(current->begin(), current->end(), participant) != current->end();
+        
+        if (online == listed) {
+            return;
+        }
+        
+        auto next = std::make_shared<std::vector<std::shared_ptr<Participant>>>();
+        next->reserve(current->size() + 1);
+        for (const auto& entry : *current) {
+            if (entry != participant) {
+                next->push_back(entry);
+            }
+        }
+        if (online) {
+            next->push_back(participant);
+        }
+        
+        std::atomic_store(&online_, ParticipantSnapshot(std::move(next)));
+    }
+};
+
+// Durable, append-only message log
+// Each numbered segment file starts with "CHJL" + format version (u16) and
+// is followed by records
+//   [length:u32][checksum:u32][kind:u8][timestamp:i64][sender_len:u16][sender]
+//   [recipient_len:u16][recipient][content_len:u32][content]
+// (little-endian; checksum is FNV-1a over everything after it). A segment
+// with another version or no header is refused rather than guessed at.
+// append() only queues the encoded record; a writer thread commits queued records in
+// groups with one write and one fdatasync per batch. Only the newest
+// max_segments segments are kept; older ones are deleted at startup and on
+// rotation, which bounds both disk use and recovery time. At startup every
+// kept segment is mapped read-only and replayed in order without copying:
+// private histories (the last 1000 messages of each participant) can
+// reach back to any of them, so stopping once the public ring is full
+// would lose them. A torn record at the tail of the newest one is cut off
+// before new appends.
+class MessageJournal {
+public:
+    static constexpr uint64_t DEFAULT_SEGMENT_BYTES = 64ull * 1024 * 1024;
+    static constexpr size_t DEFAULT_MAX_SEGMENTS = 16;
+    static constexpr char MAGIC[4] = {'C', 'H', 'J', 'L'};
+    static constexpr uint16_t FORMAT_VERSION = 2;   // bumped whenever the record layout changes
+    static constexpr size_t HEADER_SIZE = 6;
+    
+    enum Kind : uint8_t {
+        PUBLIC = 0,
+        PRIVATE = 1
+    };
+    
+    struct Entry {
+        Kind kind;
+        std::chrono::system_clock::time_point timestamp;
+        boost::beast::string_view sender;
+        boost::beast::string_view recipient;
+        boost::beast::string_view content;
+    };
+
+private:
+    static constexpr size_t MIN_BODY_SIZE = 4 + 1 + 8 + 2 + 2 + 4;
+    
+    std::filesystem::path directory_;
+    uint64_t segment_bytes_;
+    size_t max_segments_;
+    SystemLogger& logger_;
+    
+    int fd_{-1};
+    std::vector<uint32_t> segments_;
+    uint32_t segment_number_{0};
+    uint64_t segment_size_{0};
+    
+    std::mutex mutex_;
+    std::condition_variable pending_cv_;
+    std::condition_variable committed_cv_;
+    std::string pending_;
+    uint64_t appended_bytes_{0};
+    uint64_t committed_bytes_{0};       // written and fdatasync'd
+    uint64_t settled_bytes_{0};         // committed or lost to a failed batch
+    uint64_t first_lost_{UINT64_MAX};   // appended_bytes_ position of the first lost byte
+    bool running_{true};
+    std::thread writer_;
+
+public:
+    MessageJournal(const std::string& directory, SystemLogger& logger, 
+                   uint64_t segment_bytes = DEFAULT_SEGMENT_BYTES,
+                   size_t max_segments = DEFAULT_MAX_SEGMENTS)
+        : directory_(directory), segment_bytes_(segment_bytes), max_segments_(std::max<size_t>(1, max_segments)), 
+          logger_(logger) {
+        std::filesystem::create_directories(directory_);
+        
+        for (const auto& file : std::filesystem::directory_iterator(directory_)) {
+            unsigned int number = 0;
+            if (std::sscanf(file.path().filename().c_str(), "segment-%08u.log", &number) == 1) {
+                segments_.push_back(number);
+            }
+        }
+        std::sort(segments_.begin(), segments_.end());
+    }
+    
+    ~MessageJournal() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            running_ = false;
+        }
+        pending_cv_.notify_all();
+        if (writer_.joinable()) {
+            writer_.join();
+        }
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+    }
+    
+    // Replays every intact record, oldest segment first, then reopens the
+    // newest segment for appending after its last intact record and starts
+    // the writer. Returns the number of records replayed.
+    template <typename Visitor>
+    size_t open(Visitor&& visit) {
+        size_t replayed = 0;
+        uint64_t valid_bytes = 0;
+        
+        prune_segments();
+        for (uint32_t number : segments_) {
+            replayed += replay(segment_path(number), visit, valid_bytes);
+        }
+        segment_number_ = segments_.empty() ? 1 : segments_.back();
+        if (segments_.empty()) {
+            segments_.push_back(segment_number_);
+        }
+        
+        open_segment(valid_bytes);
+        prune_segments();
+        writer_ = std::thread([this]() { writer_loop(); });
+        return replayed;
+    }
+    
+    void append(Kind kind, std::chrono::system_clock::time_point timestamp, const std::string& sender,
+                const std::string& recipient, const char* content, size_t content_length) {
+        size_t body_size = MIN_BODY_SIZE + sender.size() + recipient.size() + content_length;
+        
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t start = pending_.size();
+        pending_.resize(start + 4 + body_size);
+        
+        char* out = &pending_[start];
+        put(out, body_size, 4);
+        char* body = out + 4;
+        char* cursor = body + 4;
+        put(cursor, kind, 1);
+        put(cursor + 1, static_cast<uint64_t>(timestamp.time_since_epoch().count()), 8);
+        cursor += 9;
+        put(cursor, sender.size(), 2);
+        std::memcpy(cursor + 2, sender.data(), sender.size());
+        cursor += 2 + sender.size();
+        put(cursor, recipient.size(), 2);
+        std::memcpy(cursor + 2, recipient.data(), recipient.size());
+        cursor += 2 + recipient.size();
+        put(cursor, content_length, 4);
+        std::memcpy(cursor + 4, content, content_length);
+        put(body, checksum(body + 4, body_size - 4), 4);
+        
+        appended_bytes_ += 4 + body_size;
+        pending_cv_.notify_one();
+    }
+    
+    // Blocks until the writer has handled everything appended so far.
+    // Returns false if any of it was lost to a failed write or fdatasync.
+    bool flush() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        uint64_t target = appended_bytes_;
+        committed_cv_.wait(lock, [this, target]() { return settled_bytes_ >= target; });
+        return first_lost_ >= target;
+    }
+
+private:
+    static void put(char* out, uint64_t value, int bytes) {
+        for (int i = 0; i < bytes; i++) {
+            out[i] = static_cast<char>(value >> (8 * i));
+        }
+    }
+    
+    static uint64_t get(const uint8_t* in, int bytes) {
+        uint64_t value = 0;
+        for (int i = 0; i < bytes; i++) {
+            value |= static_cast<uint64_t>(in[i]) << (8 * i);
+        }
+        return value;
+    }
+    
+    static uint32_t checksum(const char* data, size_t size) {
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < size; i++) {
+            hash = (hash ^ static_cast<uint8_t>(data[i])) * 16777619u;
+        }
+        return hash;
+    }
+    
+    std::filesystem::path segment_path(uint32_t number) const {
+        char name[32];
+        std::snprintf(name, sizeof(name), "segment-%08u.log", number);
+        return directory_ / name;
+    }
+    
+    // Splits a record body (after its checksum) into `entry`. Every length
+    // is checked against `size`, and together they must account for it
+    // exactly; a matching checksum alone does not make the lengths valid.
+    static bool decode(const uint8_t* body, size_t size, Entry& entry) {
+        size_t fixed = MIN_BODY_SIZE - 4;
+        if (size < fixed || body[0] > PRIVATE) {
+            return false;
+        }
+        
+        entry.kind = static_cast<Kind>(body[0]);
+        entry.timestamp = std::chrono::system_clock::time_point(std::chrono::system_clock::duration(
+            static_cast<int64_t>(get(body + 1, 8))));
+        size_t offset = 9;
+        size_t left = size - fixed;
+        
+        auto field = [&](int length_bytes, boost::beast::string_view& out) {
+            size_t length = static_cast<size_t>(get(body + offset, length_bytes));
+            offset += static_cast<size_t>(length_bytes);
+            if (length > left) {
+                return false;
+            }
+            out = boost::beast::string_view(reinterpret_cast<const char*>(body + offset), length);
+            offset += length;
+            left -= length;
+            return true;
+        };
+        return field(2, entry.sender) && field(2, entry.recipient) && field(4, entry.content) && left == 0;
+    }
+    
+    template <typename Visitor>
+    size_t replay(const std::filesystem::path& path, Visitor& visit, uint64_t& valid_bytes) {
+        valid_bytes = 0;
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return 0;
+        }
+        
+        struct stat info{};
+        if (::fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < HEADER_SIZE) {
+            // Empty, or a header torn by a crash right after rotation
+            ::close(fd);
+            return 0;
+        }
+        
+        size_t size = static_cast<size_t>(info.st_size);
+        void* mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED) {
+            throw std::runtime_error("Cannot map journal segment " + path.string());
+        }
+        ::madvise(mapping, size, MADV_SEQUENTIAL);
+        
+        const auto* data = static_cast<const uint8_t*>(mapping);
+        if (std::memcmp(data, MAGIC, sizeof(MAGIC)) != 0) {
+            ::munmap(mapping, size);
+            throw std::runtime_error("Journal segment " + path.string() + " has no journal header");
+        }
+        uint16_t version = static_cast<uint16_t>(get(data + 4, 2));
+        if (version != FORMAT_VERSION) {
+            ::munmap(mapping, size);
+            throw std::runtime_error("Journal segment " + path.string() + " has unsupported format version " + 
+                                     std::to_string(version));
+        }
+        size_t offset = HEADER_SIZE;
+        size_t replayed = 0;
+        
+        while (offset + 4 <= size) {
+            size_t body_size = static_cast<size_t>(get(data + offset, 4));
+            if (body_size < 4 || body_size > size - offset - 4) {
+                break;
+            }
+            
+            const uint8_t* body = data + offset + 4;
+            if (get(body, 4) != checksum(reinterpret_cast<const char*>(body + 4), body_size - 4)) {
+                break;
+            }
+            
+            Entry entry;
+            if (!decode(body + 4, body_size - 4, entry)) {
+                SYSTEM_LOG(logger_, LogLevel::WARN, "Journal " + path.filename().string() + ": registro con longitudes " 
+                           "inválidas en el byte " + std::to_string(offset));
+                break;
+            }
+            
+            visit(entry);
+            replayed++;
+            offset += 4 + body_size;
+        }
         
-        response.insert(response.end(), content_begin, content_end);
+        if (offset < size) {
+            SYSTEM_LOG(logger_, LogLevel::WARN, "Journal " + path.filename().string() + ": descartando " + 
+                       std::to_string(size - offset) + " bytes incompletos al final");
+        }
         
-        return response;
+        ::munmap(mapping, size);
+        valid_bytes = offset;
+        return replayed;
     }
     
-    static std::vector<uint8_t> create_history_response(const std::vector<Communication>& history) {
-        uint8_t count = static_cast<uint8_t>(std::min(history.size(), static_cast<size_t>(255)));
-        
-        std::vector<uint8_t> response = {protocol::ServerResponse::COMMUNICATION_HISTORY, count};
+    // Deletes the oldest segments beyond max_segments_. Runs before the
+    // writer starts and then only on the writer thread.
+    void prune_segments() {
+        while (segments_.size() > max_segments_) {
+            auto path = segment_path(segments_.front());
+            std::error_code ignored;
+            std::filesystem::remove(path, ignored);
+            segments_.erase(segments_.begin());
+            SYSTEM_LOG(logger_, LogLevel::INFO, "Journal: segmento " + path.filename().string() + " eliminado (se conservan " + 
+                       std::to_string(max_segments_) + ")");
+        }
+    }
+    
+    void open_segment(uint64_t valid_bytes) {
+        auto path = segment_path(segment_number_);
+        fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+        if (fd_ < 0) {
+            throw std::runtime_error("Cannot open journal segment " + path.string());
+        }
+        if (::ftruncate(fd_, static_cast<off_t>(valid_bytes)) != 0 || 
+            ::lseek(fd_, static_cast<off_t>(valid_bytes), SEEK_SET) < 0) {
+            throw std::runtime_error("Cannot position journal segment " + path.string());
+        }
+        if (valid_bytes == 0) {
+            char header[HEADER_SIZE];
+            std::memcpy(header, MAGIC, sizeof(MAGIC));
+            put(header + 4, FORMAT_VERSION, 2);
+            if (::write(fd_, header, sizeof(header)) != static_cast<ssize_t>(sizeof(header))) {
+                throw std::runtime_error("Cannot write journal segment header " + path.string());
+            }
+            valid_bytes = HEADER_SIZE;
+        }
+        segment_size_ = valid_bytes;
+    }
+    
+    void writer_loop() {
+        std::string batch;
+        std::unique_lock<std::mutex> lock(mutex_);
         
-        for (size_t i = 0; i < count; i++) {
-            const auto& comm = history[i];
-            
-            uint8_t sender_size = static_cast<uint8_t>(comm.sender.size());
-            response.push_back(sender_size);
-            response.insert(response.end(), comm.sender.begin(), comm.sender.end());
+        for (;;) {
+            pending_cv_.wait(lock, [this]() { return !pending_.empty() || !running_; });
+            if (pending_.empty()) {
+                return;
+            }
             
-            uint8_t content_size = static_cast<uint8_t>(std::min(comm.content.size(), static_cast<size_t>(255)));
-            response.push_back(content_size);
+            batch.swap(pending_);
+            lock.unlock();
             
-            auto content_begin = comm.content.begin();
-            auto content_end = content_size < comm.content.size() ? content_begin + content_size : comm.content.end();
+            bool written = write_batch(batch);
+            uint64_t size = batch.size();
+            batch.clear();
             
-            response.insert(response.end(), content_begin, content_end);
+            lock.lock();
+            if (written) {
+                committed_bytes_ += size;
+            } else {
+                first_lost_ = std::min(first_lost_, settled_bytes_);
+            }
+            settled_bytes_ += size;
+            committed_cv_.notify_all();
         }
-        
-        return response;
     }
     
-    static std::string parse_query_parameter(const std::string& query_string, const std::string& param_name) {
-        std::string value;
-        
-        size_t pos = query_string.find(param_name + "=");
-        if (pos != std::string::npos) {
-            value = query_string.substr(pos + param_name.size() + 1);
-            
-            pos = value.find('&');
-            if (pos != std::string::npos) {
-                value = value.substr(0, pos);
+    // Writes and syncs one batch. On failure the batch is dropped and the
+    // segment cut back to its last complete batch, so no later record is
+    // appended after a torn one; if that fails too, writing goes on in a
+    // new segment.
+    bool write_batch(const std::string& batch) {
+        size_t offset = 0;
+        while (offset < batch.size()) {
+            ssize_t written = ::write(fd_, batch.data() + offset, batch.size() - offset);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                SYSTEM_LOG(logger_, LogLevel::ERROR, "Journal write failed: " + std::string(std::strerror(errno)) + 
+                           "; se descartan " + std::to_string(batch.size()) + " bytes");
+                break;
             }
-            
-            boost::replace_all(value, "%20", " ");
+            offset += static_cast<size_t>(written);
+        }
+        if (offset == batch.size() && ::fdatasync(fd_) != 0) {
+            SYSTEM_LOG(logger_, LogLevel::ERROR, "Journal fdatasync failed: " + std::string(std::strerror(errno)) + 
+                       "; se descartan " + std::to_string(batch.size()) + " bytes");
+            offset = 0;
+        }
+        if (offset < batch.size()) {
+            if (fd_ < 0 || ::ftruncate(fd_, static_cast<off_t>(segment_size_)) != 0 ||
+                ::lseek(fd_, static_cast<off_t>(segment_size_), SEEK_SET) < 0) {
+                rotate();
+            }
+            return false;
         }
         
-        return value;
+        // Segments are only rotated between batches, so a record never spans two files.
+        segment_size_ += batch.size();
+        if (segment_size_ >= segment_bytes_) {
+            rotate();
+        }
+        return true;
+    }
+    
+    // Starts the next segment. If it cannot be opened, fd_ stays closed
+    // and the next batch fails and tries again.
+    void rotate() {
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+        segment_number_++;
+        segments_.push_back(segment_number_);
+        try {
+            open_segment(0);
+        } catch (const std::runtime_error& e) {
+            SYSTEM_LOG(logger_, LogLevel::ERROR, e.what());
+            if (fd_ >= 0) {
+                ::close(fd_);
+                fd_ = -1;
+            }
+        }
+        if (fd_ >= 0) {
+            SYSTEM_LOG(logger_, LogLevel::INFO, "Journal: nuevo segmento " + segment_path(segment_number_).filename().string());
+        }
+        prune_segments();
     }
 };
 
-// Registry of all participants
-class ParticipantRegistry {
+// Central communication repository
+class CommunicationRepository {
 private:
-    std::unordered_map<std::string, std::shared_ptr<Participant>> participants_;
+    static constexpr size_t MAX_HISTORY_SIZE = 1000;
+    // Room for MAX_HISTORY_SIZE messages of the longest allowed content,
+    // plus the gap a message that does not fit before the end can leave.
+    static constexpr size_t PUBLIC_ARENA_BYTES = (MAX_HISTORY_SIZE + 1) * protocol::MAX_CONTENT_LENGTH;
+    static constexpr size_t MAX_PAGE_SIZE = 500;
+    
+    // Encoded COMMUNICATION_HISTORY for "~" and the public version it was built from
+    struct HistoryCache {
+        uint64_t version;
+        SharedFrame frame;
+    };
+    
+    PublicHistoryRing public_communications_{MAX_HISTORY_SIZE, PUBLIC_ARENA_BYTES};
     std::mutex mutex_;
-    SystemLogger& logger_;
+    MessageJournal* journal_{nullptr};
+    std::atomic<uint64_t> public_version_{0};   // bumped under mutex_ after every public append
+    std::array<std::shared_ptr<const HistoryCache>, 2> history_cache_;  // per wire version; std::atomic_load/store
 
 public:
-    explicit ParticipantRegistry(SystemLogger& logger) : logger_(logger) {}
-
-    std::mutex& get_mutex() {
-        return mutex_;
-    }
-    
-    bool register_participant(const std::string& id, 
-                              std::shared_ptr<ws::stream<tcp::socket>> conn,
-                              io::ip::address addr) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        
-        auto it = participants_.find(id);
-        if (it != participants_.end()) {
-            if (it->second->availability != protocol::Availability::OFFLINE) {
-                return false;
+    // Rebuilds history from the journal and journals every later message.
+    // Must be called before the server starts accepting connections.
+    size_t attach_journal(MessageJournal& journal, ParticipantRegistry& registry) {
+        size_t replayed = journal.open([this, &registry](const MessageJournal::Entry& entry) {
+            if (entry.kind == MessageJournal::PUBLIC) {
+                public_communications_.append(std::string(entry.sender), entry.content.data(), 
+                                              entry.content.size(), entry.timestamp);
+            } else {
+                Communication comm(std::string(entry.sender), std::string(entry.recipient), 
+                                   std::string(entry.content));
+                comm.timestamp = entry.timestamp;
+                store_private(comm, registry.restore_participant(comm.sender), 
+                              registry.restore_participant(comm.recipient));
             }
-            
-            it->second->connection = conn;
-            it->second->availability = protocol::Availability::AVAILABLE;
-            it->second->update_last_activity();
-            it->second->network_address = addr;
-        } else {
-            participants_[id] = std::make_shared<Participant>(id, conn, addr);
-        }
+        });
         
-        return true;
+        journal_ = &journal;
+        return replayed;
     }
     
-    std::shared_ptr<Participant> get_participant(const std::string& id) {
+    void add_public_communication(const std::string& sender, boost::beast::string_view content) {
+        auto now = std::chrono::system_clock::now();
         std::lock_guard<std::mutex> lock(mutex_);
-        auto it = participants_.find(id);
-        if (it != participants_.end()) {
-            return it->second;
+        public_communications_.append(sender, content.data(), content.size(), now);
+        public_version_++;
+        if (journal_) {
+            journal_->append(MessageJournal::PUBLIC, now, sender, "~", content.data(), content.size());
         }
-        return nullptr;
     }
     
-    bool set_availability(const std::string& id, protocol::Availability status) {
+    void add_private_communication(const Communication& comm, 
+                                   std::shared_ptr<Participant> sender,
+                                   std::shared_ptr<Participant> recipient) {
         std::lock_guard<std::mutex> lock(mutex_);
-        auto it = participants_.find(id);
-        if (it != participants_.end()) {
-            it->second->availability = status;
-            it->second->update_last_activity();
-            return true;
+        store_private(comm, sender, recipient);
+        if (journal_) {
+            journal_->append(MessageJournal::PRIVATE, comm.timestamp, comm.sender, comm.recipient,
+                             comm.content.data(), comm.content.size());
         }
-        return false;
     }
     
-    std::vector<std::shared_ptr<Participant>> get_all_participants() {
+    std::vector<Communication> get_public_history(size_t max_count = 255) {
         std::lock_guard<std::mutex> lock(mutex_);
-        std::vector<std::shared_ptr<Participant>> result;
         
-        for (const auto& [id, participant] : participants_) {
-            if (participant->availability != protocol::Availability::OFFLINE) {
-                result.push_back(participant);
-            }
-        }
+        std::vector<Communication> result;
+        public_communications_.for_each_last(max_count, 
+            [&result](const std::string& sender, boost::beast::string_view content,
+                      std::chrono::system_clock::time_point timestamp) {
+                result.emplace_back(sender, "~", std::string(content));
+                result.back().timestamp = timestamp;
+            });
         
         return result;
     }
     
-    void broadcast(const std::vector<uint8_t>& message) {
+    // The public history response every client gets on opening "~". It is
+    // encoded straight from the ring's arena once per public version and
+    // wire version, and every fetch in between shares the same buffer.
+    SharedFrame public_history_frame(protocol::WireVersion version) {
+        auto& slot = history_cache_[version == protocol::WireVersion::V2 ? 1 : 0];
+        auto cached = std::atomic_load(&slot);
+        if (cached && cached->version == public_version_.load()) {
+            return cached->frame;
+        }
+        
+        // Rebuild under the lock so the version matches the ring contents,
+        // and re-check in case a concurrent fetch rebuilt it first.
         std::lock_guard<std::mutex> lock(mutex_);
+        uint64_t current = public_version_.load();
+        cached = std::atomic_load(&slot);
+        if (cached && cached->version == current) {
+            return cached->frame;
+        }
+        
+        auto frame = ProtocolUtils::freeze(ProtocolUtils::create_history_response(public_communications_, 255, version));
+        std::atomic_store(&slot, std::shared_ptr<const HistoryCache>(
+            std::make_shared<const HistoryCache>(HistoryCache{current, frame})));
+        return frame;
+    }
     
-        for (auto& [id, participant] : participants_) {
-            if (participant && participant->connection && participant->availability != protocol::Availability::OFFLINE) {
-                try {
-                    participant->connection->text(false); // 👈 false = mensaje binario
-                    participant->connection->write(boost::asio::buffer(message));
-                } catch (const std::exception& e) {
-                    logger_.record("Failed to broadcast to " + id + ": " + e.what());
-                }
-            } else {
-                logger_.record("Omitido " + id + " (sin conexión o inactivo)");
+    // One page of a channel's history, numbered below `before` (0 = newest).
+    // The public ring and each personal history are indexed by sequence
+    // number, so a page costs O(page_size) wherever it starts.
+    std::vector<uint8_t> encode_page(boost::beast::string_view channel, const std::shared_ptr<Participant>& participant,
+                                     uint64_t before, size_t page_size, protocol::WireVersion version) {
+        page_size = std::min(page_size, MAX_PAGE_SIZE);
+        auto response = ProtocolUtils::create_page_header(channel, version);
+        size_t header_size = response.size();
+        
+        std::lock_guard<std::mutex> lock(mutex_);
+        uint64_t first;
+        uint64_t retained_from;
+        size_t count = 0;
+        
+        if (!participant) {
+            first = public_communications_.for_each_before(before, page_size, 
+                [&response, &count, version](const std::string& sender, boost::beast::string_view content,
+                                             std::chrono::system_clock::time_point timestamp) {
+                    ProtocolUtils::append_page_entry(response, sender, content, timestamp, version);
+                    count++;
+                });
+            retained_from = public_communications_.first_sequence();
+        } else {
+            const auto& history = participant->personal_history;
+            retained_from = participant->history_first_sequence;
+            uint64_t next = retained_from + history.size();
+            uint64_t end = (before == 0 || before > next) ? next : std::max(before, retained_from);
+            first = end - std::min<uint64_t>(end - retained_from, page_size);
+            
+            for (uint64_t sequence = first; sequence < end; sequence++) {
+                const auto& comm = history[static_cast<size_t>(sequence - retained_from)];
+                ProtocolUtils::append_page_entry(response, comm.sender, comm.content, comm.timestamp, version);
+                count++;
             }
         }
+        
+        ProtocolUtils::finish_page(response, header_size, first, count, first > retained_from);
+        return response;
     }
-    void update_connection(const std::string& id, std::shared_ptr<ws::stream<tcp::socket>> connection) {
+    
+    size_t public_history_bytes() {
         std::lock_guard<std::mutex> lock(mutex_);
-        auto it = participants_.find(id);
-        if (it != participants_.end()) {
-            it->second->connection = connection;
-            it->second->availability = protocol::Availability::AVAILABLE;
-            it->second->update_last_activity();
-        }
+        return public_communications_.bytes_used();
     }
     
+    double public_bytes_per_message() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return public_communications_.bytes_per_message();
+    }
     
-};
-
-// Central communication repository
-class CommunicationRepository {
-private:
-    std::deque<Communication> public_communications_;
-    std::mutex mutex_;
-    static constexpr size_t MAX_HISTORY_SIZE = 1000;
-
-public:
-    void add_public_communication(const Communication& comm) {
+    std::vector<Communication> get_private_history(std::shared_ptr<Participant> participant, 
+                                                  size_t max_count = 255) {
+        std::vector<Communication> result;
+        
+        if (!participant) {
+            return result;
+        }
+        
         std::lock_guard<std::mutex> lock(mutex_);
-        public_communications_.push_back(comm);
+        size_t count = std::min(participant->personal_history.size(), max_count);
         
-        if (public_communications_.size() > MAX_HISTORY_SIZE) {
-            public_communications_.pop_front();
+        if (count > 0) {
+            auto start = participant->personal_history.end() - count;
+            for (size_t i = 0; i < count; i++) {
+                result.push_back(*(start + i));
+            }
         }
+        
+        return result;
     }
-    
-    void add_private_communication(const Communication& comm, 
-                                   std::shared_ptr<Participant> sender,
-                                   std::shared_ptr<Participant> recipient) {
+
+private:
+    void store_private(const Communication& comm, 
+                       const std::shared_ptr<Participant>& sender,
+                       const std::shared_ptr<Participant>& recipient) {
         // Add to sender's history
         if (sender) {
             sender->personal_history.push_back(comm);
             if (sender->personal_history.size() > MAX_HISTORY_SIZE) {
                 sender->personal_history.pop_front();
+                sender->history_first_sequence++;
             }
         }
         
@@ -417,103 +3200,197 @@ public:
             recipient->personal_history.push_back(comm);
             if (recipient->personal_history.size() > MAX_HISTORY_SIZE) {
                 recipient->personal_history.pop_front();
+                recipient->history_first_sequence++;
             }
         }
     }
+};
+
+// Hierarchical timing wheel with one-second ticks. Level L has SLOTS
+// buckets, each LEVEL_SPAN^L ticks wide; entries cascade down a level when
+// the lower wheel wraps, so insertion and expiry are O(1) per entry.
+template <typename T>
+class TimerWheel {
+public:
+    static constexpr size_t SLOTS = 64;
+    static constexpr size_t LEVELS = 4;     // 64^4 ticks, about 194 days
+
+private:
+    struct Entry {
+        uint64_t deadline;
+        T value;
+    };
     
-    std::vector<Communication> get_public_history(size_t max_count = 255) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        
-        std::vector<Communication> result;
-        size_t count = std::min(public_communications_.size(), max_count);
-        
-        if (count > 0) {
-            auto start = public_communications_.end() - count;
-            for (size_t i = 0; i < count; i++) {
-                result.push_back(*(start + i));
-            }
-        }
-        
-        return result;
+    std::array<std::array<std::vector<Entry>, SLOTS>, LEVELS> wheels_;
+    uint64_t current_{0};
+
+public:
+    uint64_t now() const {
+        return current_;
     }
     
-    std::vector<Communication> get_private_history(std::shared_ptr<Participant> participant, 
-                                                  size_t max_count = 255) {
-        std::vector<Communication> result;
+    void schedule(uint64_t deadline, T value) {
+        insert(std::max(deadline, current_ + 1), std::move(value));
+    }
+    
+    // Advances one tick and moves every entry that is now due into `due`.
+    void advance(std::vector<T>& due) {
+        current_++;
         
-        if (!participant) {
-            return result;
+        uint64_t width = 1;
+        for (size_t level = 1; level < LEVELS; level++) {
+            width *= SLOTS;
+            if (current_ % width != 0) {
+                break;
+            }
+            auto& slot = wheels_[level][(current_ / width) % SLOTS];
+            auto entries = std::move(slot);
+            slot.clear();
+            for (auto& entry : entries) {
+                insert(entry.deadline, std::move(entry.value));
+            }
         }
         
-        size_t count = std::min(participant->personal_history.size(), max_count);
+        auto& slot = wheels_[0][current_ % SLOTS];
+        for (auto& entry : slot) {
+            due.push_back(std::move(entry.value));
+        }
+        slot.clear();
+    }
+
+private:
+    // deadline >= current_; an entry due this tick lands in the level 0 slot
+    // that advance() is about to drain.
+    void insert(uint64_t deadline, T value) {
+        uint64_t delta = deadline - current_;
         
-        if (count > 0) {
-            auto start = participant->personal_history.end() - count;
-            for (size_t i = 0; i < count; i++) {
-                result.push_back(*(start + i));
-            }
+        size_t level = 0;
+        uint64_t span = SLOTS;
+        while (level + 1 < LEVELS && delta >= span) {
+            span *= SLOTS;
+            level++;
         }
         
-        return result;
+        uint64_t width = span / SLOTS;
+        wheels_[level][(deadline / width) % SLOTS].push_back({deadline, std::move(value)});
     }
 };
 
 // Activity monitor
+// Each AVAILABLE participant has one entry in a timer wheel, armed for
+// last_activity + timeout. Activity only stores a new last_activity; when an
+// entry fires early it is simply re-armed for the new deadline, so the cost
+// is per timeout period rather than per message or per poll.
 class ActivityMonitor {
     private:
         ParticipantRegistry& registry_;
         SystemLogger& logger_;
-        std::chrono::seconds inactivity_timeout_;
-        std::atomic<bool> running_;
-        std::thread monitor_thread_;
+        std::atomic<std::chrono::seconds> inactivity_timeout_;
+        io::steady_timer tick_timer_;
+        std::chrono::steady_clock::time_point started_;
+        std::mutex mutex_;
+        TimerWheel<std::weak_ptr<Participant>> wheel_;
         
     public:
-        ActivityMonitor(ParticipantRegistry& registry, SystemLogger& logger, 
+        ActivityMonitor(io::io_context& io_context, ParticipantRegistry& registry, SystemLogger& logger, 
                        std::chrono::seconds timeout = std::chrono::seconds(60))
-            : registry_(registry), logger_(logger), inactivity_timeout_(timeout), running_(true) {
+            : registry_(registry), logger_(logger), inactivity_timeout_(timeout), 
+              tick_timer_(io_context), started_(std::chrono::steady_clock::now()) {
             
-            monitor_thread_ = std::thread([this]() {
-                this->monitor_loop();
+            registry_.set_available_listener([this](const std::shared_ptr<Participant>& participant) {
+                track(participant);
             });
-            
-            monitor_thread_.detach();
+            schedule_tick();
         }
         
         ~ActivityMonitor() {
-            running_ = false;
+            tick_timer_.cancel();
         }
         
         void set_timeout(std::chrono::seconds timeout) {
             inactivity_timeout_ = timeout;
-            logger_.record("Inactivity timeout set to " + std::to_string(timeout.count()) + " seconds");
+            SYSTEM_LOG(logger_, LogLevel::INFO, "Inactivity timeout set to " + std::to_string(timeout.count()) + " seconds");
+        }
+        
+        std::chrono::seconds timeout() const {
+            return inactivity_timeout_.load();
+        }
+        
+        // Arms the participant's inactivity deadline unless it already has one.
+        void track(const std::shared_ptr<Participant>& participant) {
+            if (participant->activity_armed.exchange(true)) {
+                return;
+            }
+            
+            std::lock_guard<std::mutex> lock(mutex_);
+            wheel_.schedule(deadline_tick(participant), participant);
         }
         
     private:
-        void monitor_loop() {
-            while (running_) {
-                std::this_thread::sleep_for(std::chrono::seconds(10));
+        uint64_t deadline_tick(const std::shared_ptr<Participant>& participant) {
+            auto deadline = participant->last_activity.load() + inactivity_timeout_.load();
+            auto remaining = std::chrono::duration_cast<std::chrono::seconds>(
+                deadline - std::chrono::system_clock::now());
+            
+            // +1 rounds up so an entry never fires before its deadline.
+            return wheel_.now() + static_cast<uint64_t>(std::max<int64_t>(remaining.count(), 0)) + 1;
+        }
+        
+        void schedule_tick() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tick_timer_.expires_at(started_ + std::chrono::seconds(wheel_.now() + 1));
+            tick_timer_.async_wait([this](web::error_code ec) {
+                if (!ec) {
+                    on_tick();
+                }
+            });
+        }
+        
+        void on_tick() {
+            std::vector<std::weak_ptr<Participant>> due;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                wheel_.advance(due);
+            }
+            
+            auto now = std::chrono::system_clock::now();
+            for (auto& entry : due) {
+                auto participant = entry.lock();
+                if (participant) {
+                    expire(participant, now);
+                }
+            }
+            
+            schedule_tick();
+        }
+        
+        void expire(const std::shared_ptr<Participant>& participant, std::chrono::system_clock::time_point now) {
+            if (participant->availability == protocol::Availability::AVAILABLE &&
+                now - participant->last_activity.load() < inactivity_timeout_.load()) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                wheel_.schedule(deadline_tick(participant), participant);
+                return;
+            }
+            
+            bool went_away = registry_.set_availability_if(
+                participant, protocol::Availability::AVAILABLE, protocol::Availability::AWAY);
+            
+            // Disarm, then re-check: a participant that became AVAILABLE
+            // meanwhile may have seen the entry as still armed.
+            participant->activity_armed = false;
+            if (participant->availability == protocol::Availability::AVAILABLE) {
+                track(participant);
+            }
+            
+            if (went_away) {
+                SYSTEM_LOG(logger_, LogLevel::INFO, "Participant " + participant->identifier + " set to AWAY due to inactivity");
                 
-                auto now = std::chrono::system_clock::now();
-                auto participants = registry_.get_all_participants();
+                auto notification = ProtocolUtils::freeze_all([&participant](protocol::WireVersion version) {
+                    return ProtocolUtils::create_availability_update(
+                        participant->identifier, protocol::Availability::AWAY, version);
+                });
                 
-                for (const auto& participant : participants) {
-                    if (participant->availability == protocol::Availability::AVAILABLE) {
-                        auto inactive_time = std::chrono::duration_cast<std::chrono::seconds>(
-                            now - participant->last_activity);
-                        
-                        if (inactive_time > inactivity_timeout_) {
-                            registry_.set_availability(participant->identifier, protocol::Availability::AWAY);
-                            
-                            logger_.record("Participant " + participant->identifier + 
-                                          " set to AWAY due to inactivity");
-                            
-                            auto notification = ProtocolUtils::create_availability_update(
-                                participant->identifier, protocol::Availability::AWAY);
-                            
-                            registry_.broadcast(notification);
-                        }
-                    }
-                }
+                registry_.broadcast(notification);
             }
         }
     };
@@ -533,242 +3410,227 @@ public:
                   SystemLogger& logger)
         : registry_(registry), repository_(repository), logger_(logger) {}
     
+    // Routes one request frame; `reader` views the connection's buffer and
+    // is only valid for the duration of the call.
+    void dispatch(const std::string& requester, RequestReader& reader) {
+        uint8_t type = reader.u8();
+        
+        switch (type) {
+            case protocol::ClientRequest::GET_PARTICIPANTS:
+                reader.mark_parsed();
+                handle_get_participants(requester);
+                break;
+                
+            case protocol::ClientRequest::PARTICIPANT_INFO:
+                handle_participant_info(requester, reader);
+                break;
+                
+            case protocol::ClientRequest::SET_AVAILABILITY:
+                handle_set_availability(requester, reader);
+                break;
+                
+            case protocol::ClientRequest::SEND_COMMUNICATION:
+                handle_send_communication(requester, reader);
+                break;
+                
+            case protocol::ClientRequest::FETCH_COMMUNICATIONS:
+                handle_fetch_communications(requester, reader);
+                break;
+                
+            case protocol::ClientRequest::SYNC_PRESENCE:
+                handle_sync_presence(requester, reader);
+                break;
+                
+            case protocol::ClientRequest::FETCH_PAGE:
+                handle_fetch_page(requester, reader);
+                break;
+                
+            default:
+                SYSTEM_LOG(logger_, LogLevel::WARN, "Unknown message type from " + requester + ": " + 
+                           std::to_string(type));
+                break;
+        }
+    }
+    
     void handle_get_participants(const std::string& requester) {
-        logger_.record("Participant " + requester + " requests participant list");
+        SYSTEM_LOG(logger_, LogLevel::DEBUG, "Participant " + requester + " requests participant list");
         
-        auto participants = registry_.get_all_participants();
-        auto response = ProtocolUtils::create_participant_list(participants);
+        auto response = registry_.participant_list_frame();
         
         auto requester_participant = registry_.get_participant(requester);
     
         if (!requester_participant) {
-            logger_.record("Requester " + requester + " no encontrado en el registro");
-            return;
-        }
-    
-        if (!requester_participant->connection) {
-            logger_.record("Conexión nula para el participante " + requester + ", no se puede enviar la lista");
+            SYSTEM_LOG(logger_, LogLevel::WARN, "Requester " + requester + " no encontrado en el registro");
             return;
         }
     
-        try {
-            requester_participant->connection->text(false); // binario
-            requester_participant->connection->write(boost::asio::buffer(response));
-        } catch (const std::exception& e) {
-            logger_.record("Failed to send participant list to " + requester + ": " + e.what());
+        if (!registry_.deliver(requester_participant, std::move(response))) {
+            SYSTEM_LOG(logger_, LogLevel::WARN, "Conexión nula para el participante " + requester + ", no se puede enviar la lista");
         }
     }
         
     
-    void handle_participant_info(const std::string& requester, const std::vector<uint8_t>& data) {
-        if (data.size() < 2) {
-            auto error = ProtocolUtils::create_error_response(protocol::FailureReason::PARTICIPANT_UNKNOWN);
-            send_to_participant(requester, error);
-            return;
-        }
-        
-        uint8_t id_length = data[1];
-        if (data.size() < 2 + id_length) {
+    void handle_participant_info(const std::string& requester, RequestReader& reader) {
+        auto target_id = reader.string();
+        reader.mark_parsed();
+        if (!reader.ok()) {
             auto error = ProtocolUtils::create_error_response(protocol::FailureReason::PARTICIPANT_UNKNOWN);
             send_to_participant(requester, error);
             return;
         }
         
-        std::string target_id(data.begin() + 2, data.begin() + 2 + id_length);
-        logger_.record("Participant " + requester + " requests info for " + target_id);
+        SYSTEM_LOG(logger_, LogLevel::DEBUG, "Participant " + requester + " requests info for " + std::string(target_id));
         
         auto target = registry_.get_participant(target_id);
-        auto response = ProtocolUtils::create_participant_details(target);
+        auto response = ProtocolUtils::create_participant_details(target, reader.version());
         
-        send_to_participant(requester, response);
+        send_to_participant(requester, std::move(response));
     }
     
-    void handle_set_availability(const std::string& requester, const std::vector<uint8_t>& data) {
-        if (data.size() < 3) {
-            auto error = ProtocolUtils::create_error_response(protocol::FailureReason::INVALID_AVAILABILITY);
-            send_to_participant(requester, error);
-            return;
-        }
-        
-        uint8_t id_length = data[1];
-        if (data.size() < 2 + id_length + 1) {
+    void handle_set_availability(const std::string& requester, RequestReader& reader) {
+        auto target_id = reader.string();
+        uint8_t status = reader.u8();
+        reader.mark_parsed();
+        if (!reader.ok()) {
             auto error = ProtocolUtils::create_error_response(protocol::FailureReason::INVALID_AVAILABILITY);
             send_to_participant(requester, error);
             return;
         }
         
-        std::string target_id(data.begin() + 2, data.begin() + 2 + id_length);
-        uint8_t status = data[2 + id_length];
-        
         if (status > 3) {
             auto error = ProtocolUtils::create_error_response(protocol::FailureReason::INVALID_AVAILABILITY);
             send_to_participant(requester, error);
             return;
         }
         
-        logger_.record("Participant " + requester + " requests availability change for " + 
-                      target_id + " to " + std::to_string(status));
+        SYSTEM_LOG(logger_, LogLevel::DEBUG, "Participant " + requester + " requests availability change for " + 
+                   std::string(target_id) + " to " + std::to_string(status));
         
-        if (requester != target_id) {
+        if (target_id != requester) {
             auto error = ProtocolUtils::create_error_response(protocol::FailureReason::PARTICIPANT_UNKNOWN);
             send_to_participant(requester, error);
             return;
         }
         
-        auto target = registry_.get_participant(target_id);
+        // From here on the target is the requester, whose id is already owned.
+        auto target = registry_.get_participant(requester);
         if (!target || target->availability == protocol::Availability::OFFLINE) {
             auto error = ProtocolUtils::create_error_response(protocol::FailureReason::PARTICIPANT_UNKNOWN);
             send_to_participant(requester, error);
             return;
         }
         
-        registry_.set_availability(target_id, static_cast<protocol::Availability>(status));
-
-        // Si el usuario pasó a estado ACTIVO, entregarle los mensajes pendientes
-        if (status == protocol::Availability::AVAILABLE) {
-            auto participant = registry_.get_participant(target_id);
-            if (participant && participant->connection) {
-                while (!participant->mensajes_pendientes.empty()) {
-                    try {
-                        auto& msg = participant->mensajes_pendientes.front();
-                        participant->connection->write(boost::asio::buffer(msg));
-                        participant->mensajes_pendientes.pop_front();
-                        logger_.record("Mensaje pendiente entregado a " + target_id);
-                    } catch (const std::exception& e) {
-                        logger_.record("Error al enviar mensaje pendiente a " + target_id + ": " + e.what());
-                        break;
-                    }
-                }
-            }
-        }
-
+        // Pasar a ACTIVO o AUSENTE entrega los mensajes pendientes
+        registry_.set_availability(requester, static_cast<protocol::Availability>(status));
         
-        auto notification = ProtocolUtils::create_availability_update(target_id, static_cast<protocol::Availability>(status));
+        auto notification = ProtocolUtils::freeze_all([&requester, status](protocol::WireVersion wire_version) {
+            return ProtocolUtils::create_availability_update(
+                requester, static_cast<protocol::Availability>(status), wire_version);
+        });
         registry_.broadcast(notification);
     }
     
-    void handle_send_communication(const std::string& sender, const std::vector<uint8_t>& data) {
-        if (data.size() < 2) {
+    void handle_send_communication(const std::string& sender, RequestReader& reader) {
+        auto recipient = reader.string();
+        auto content = reader.string();
+        reader.mark_parsed();
+        if (!reader.ok() || content.empty()) {
             auto error = ProtocolUtils::create_error_response(protocol::FailureReason::COMMUNICATION_EMPTY);
             send_to_participant(sender, error);
-            return;
-        }
-        
-        uint8_t recipient_length = data[1];
-        if (data.size() < 2 + recipient_length + 1) {
-            auto error = ProtocolUtils::create_error_response(protocol::FailureReason::COMMUNICATION_EMPTY);
-            send_to_participant(sender, error);
-            return;
-        }
-        
-        std::string recipient(data.begin() + 2, data.begin() + 2 + recipient_length);
-        
-        uint8_t content_length = data[2 + recipient_length];
-        if (data.size() < 3 + recipient_length + content_length) {
-            auto error = ProtocolUtils::create_error_response(protocol::FailureReason::COMMUNICATION_EMPTY);
-            send_to_participant(sender, error);
-            return;
-        }
-        
-        std::string content(data.begin() + 3 + recipient_length, data.begin() + 3 + recipient_length + content_length);
-        
-        if (content.empty()) {
-            auto error = ProtocolUtils::create_error_response(protocol::FailureReason::COMMUNICATION_EMPTY);
+            return;
+        }
+        if (content.size() > protocol::MAX_CONTENT_LENGTH) {
+            auto error = ProtocolUtils::create_error_response(protocol::FailureReason::COMMUNICATION_TOO_LONG);
             send_to_participant(sender, error);
             return;
         }
         
-        logger_.record("Participant " + sender + " sends communication to " + recipient + ": " + content);
+        SYSTEM_LOG(logger_, LogLevel::DEBUG, "Participant " + sender + " sends communication to " + std::string(recipient) + 
+                   " (" + std::to_string(content.size()) + " bytes)");
         
         auto sender_participant = registry_.get_participant(sender);
         if (sender_participant) {
             sender_participant->update_last_activity();
         }
         
-        auto response = ProtocolUtils::create_communication_message(sender, content);
+        auto response = ProtocolUtils::freeze_all([&sender, content](protocol::WireVersion wire_version) {
+            return ProtocolUtils::create_communication_message(sender, content, wire_version);
+        });
 
         
         if (recipient == "~") {  // Public communication
             if (sender_participant->availability == protocol::Availability::AWAY) {
-                sender_participant->availability = protocol::Availability::AVAILABLE;
-                logger_.record("Participant " + sender + " changed to " + std::to_string(static_cast<int>(sender_participant->availability)) + " after sending a message");     
+                registry_.set_availability(sender, protocol::Availability::AVAILABLE);
+                SYSTEM_LOG(logger_, LogLevel::DEBUG, "Participant " + sender + " changed to " + 
+                           std::to_string(static_cast<int>(sender_participant->availability.load())) + " after sending a message");
             }
-            Communication comm(sender, recipient, content);
-            repository_.add_public_communication(comm);
+            repository_.add_public_communication(sender, content);
             
-            registry_.broadcast(response);
+            size_t recipients = registry_.broadcast(response);
+            logger_.event(events::PUBLIC_MESSAGE, sender_participant->number, 0,
+                          static_cast<uint32_t>(content.size()), static_cast<uint16_t>(std::min<size_t>(recipients, 0xFFFF)));
         } else {  // Private communication
             auto recipient_participant = registry_.get_participant(recipient);
             
-            if (!recipient_participant || recipient_participant->availability == protocol::Availability::OFFLINE) {
+            if (!recipient_participant) {
                 auto error = ProtocolUtils::create_error_response(protocol::FailureReason::PARTICIPANT_UNAVAILABLE);
                 send_to_participant(sender, error);
                 return;
             }
             if (sender_participant->availability == protocol::Availability::AWAY) {
-                sender_participant->availability = protocol::Availability::AVAILABLE;
-                logger_.record("Participant " + sender + " changed to " + std::to_string(static_cast<int>(sender_participant->availability)) + " after sending a message");     
+                registry_.set_availability(sender, protocol::Availability::AVAILABLE);
+                SYSTEM_LOG(logger_, LogLevel::DEBUG, "Participant " + sender + " changed to " + 
+                           std::to_string(static_cast<int>(sender_participant->availability.load())) + " after sending a message");
             }
 
-            Communication comm(sender, recipient, content);
+            // The stored copy is the only owned one.
+            Communication comm(sender, recipient_participant->identifier, std::string(content));
             repository_.add_private_communication(comm, sender_participant, recipient_participant);
             
-            bool delivered = false;
-            
-            if (recipient_participant->availability == protocol::Availability::AVAILABLE || recipient_participant->availability == protocol::Availability::AWAY) {
-                try {
-                    recipient_participant->connection->write(io::buffer(response));
-                    delivered = true;
-            
-                    sender_participant->connection->write(io::buffer(response));
-                } catch (const std::exception& e) {
-                    logger_.record("Failed to deliver communication to " + recipient + ": " + e.what());
-                }
-            } else if (recipient_participant->availability == protocol::Availability::BUSY) {
-                recipient_participant->mensajes_pendientes.push_back(response);
-                logger_.record("Mensaje para " + recipient + " guardado en cola por estar OCUPADO");
-            
-                try {
-                    sender_participant->connection->write(io::buffer(response)); // confirmación al emisor
-                } catch (const std::exception& e) {
-                    logger_.record("Failed to send confirmation to " + sender + ": " + e.what());
-                }
-            } else {
-                auto error = ProtocolUtils::create_error_response(protocol::FailureReason::PARTICIPANT_UNAVAILABLE);
-                try {
-                    sender_participant->connection->write(io::buffer(error));
-                } catch (const std::exception& e) {
-                    logger_.record("Failed to send error to " + sender + ": " + e.what());
-                }
+            // OCUPADO o DESCONECTADO: se guarda hasta que vuelva a estar disponible
+            auto outcome = registry_.deliver_or_hold(recipient_participant, response, sender, content);
+            bool delivered = outcome == PendingStore::Outcome::QUEUED;
+            if (outcome == PendingStore::Outcome::REFUSED) {
+                SYSTEM_LOG(logger_, LogLevel::WARN, "Failed to deliver communication to " + recipient_participant->identifier);
             }
-                     
             
-            logger_.record("Communication from " + sender + " to " + recipient + 
-                          (delivered ? " delivered" : " not delivered (recipient busy or away)"));
+            registry_.deliver(sender_participant, response); // confirmación al emisor
+            
+            SYSTEM_LOG(logger_, LogLevel::DEBUG, "Communication from " + sender + " to " + recipient_participant->identifier + 
+                       (delivered ? " delivered" : outcome == PendingStore::Outcome::HELD ? " held (recipient busy, offline or with backlog)" : " refused"));
+            logger_.event(events::PRIVATE_MESSAGE, sender_participant->number, recipient_participant->number,
+                          static_cast<uint32_t>(content.size()), delivered ? 1 : 0);
         }
     }
     
-    void handle_fetch_communications(const std::string& requester, const std::vector<uint8_t>& data) {
-        if (data.size() < 2) {
-            auto error = ProtocolUtils::create_error_response(protocol::FailureReason::PARTICIPANT_UNKNOWN);
-            send_to_participant(requester, error);
-            return;
-        }
+    // An empty or short request asks for the full list.
+    void handle_sync_presence(const std::string& requester, RequestReader& reader) {
+        uint64_t since = reader.size() >= 9 ? reader.u64() : 0;
+        reader.mark_parsed();
+        SYSTEM_LOG(logger_, LogLevel::DEBUG, "Participant " + requester + " syncs presence since version " + std::to_string(since));
         
-        uint8_t channel_length = data[1];
-        if (data.size() < 2 + channel_length) {
+        auto participant = registry_.get_participant(requester);
+        if (participant) {
+            registry_.deliver(participant, registry_.presence_since(since, reader.version()));
+        }
+    }
+    
+    void handle_fetch_communications(const std::string& requester, RequestReader& reader) {
+        auto channel = reader.string();
+        reader.mark_parsed();
+        if (!reader.ok()) {
             auto error = ProtocolUtils::create_error_response(protocol::FailureReason::PARTICIPANT_UNKNOWN);
             send_to_participant(requester, error);
             return;
         }
+
+        SYSTEM_LOG(logger_, LogLevel::DEBUG, "Participant " + requester + " requests communications for channel " + std::string(channel));
         
-        std::string channel(data.begin() + 2, data.begin() + 2 + channel_length);
-        logger_.record("Participant " + requester + " requests communications for channel " + channel);
-        
-        std::vector<Communication> history;
+        SharedFrame response;
+        uint32_t channel_number = 0;
         
         if (channel == "~") {  // Public communications
-            history = repository_.get_public_history();
+            response = repository_.public_history_frame(reader.version());
         } else {  // Private communications
             auto participant = registry_.get_participant(channel);
             
@@ -778,143 +3640,459 @@ public:
                 return;
             }
             
-            history = repository_.get_private_history(participant);
+            response = ProtocolUtils::freeze(ProtocolUtils::create_history_response(
+                repository_.get_private_history(participant), reader.version()));
+            channel_number = participant->number;
+        }
+
+        if (auto participant = registry_.get_participant(requester)) {
+            logger_.event(events::HISTORY_SENT, participant->number, channel_number,
+                          static_cast<uint32_t>(response->size()));
+            registry_.deliver(participant, std::move(response));
+        }
+    }
+    
+    // [FETCH_PAGE][channel_len][channel][before:u64][page_size:u16]
+    void handle_fetch_page(const std::string& requester, RequestReader& reader) {
+        auto channel = reader.string();
+        uint64_t before = reader.u64();
+        size_t page_size = reader.u16();
+        reader.mark_parsed();
+        if (!reader.ok()) {
+            auto error = ProtocolUtils::create_error_response(protocol::FailureReason::PARTICIPANT_UNKNOWN);
+            send_to_participant(requester, error);
+            return;
+        }
+        
+        SYSTEM_LOG(logger_, LogLevel::DEBUG, "Participant " + requester + " requests " + std::to_string(page_size) + 
+                   " communications of channel " + std::string(channel) + " before " + std::to_string(before));
+        
+        std::shared_ptr<Participant> participant;
+        if (channel != "~") {
+            participant = registry_.get_participant(channel);
+            if (!participant) {
+                auto error = ProtocolUtils::create_error_response(protocol::FailureReason::PARTICIPANT_UNKNOWN);
+                send_to_participant(requester, error);
+                return;
+            }
         }
         
-        auto response = ProtocolUtils::create_history_response(history);
-        send_to_participant(requester, response);
+        auto response = repository_.encode_page(channel, participant, before, page_size, reader.version());
+        if (logger_.events_enabled()) {
+            if (auto requester_participant = registry_.get_participant(requester)) {
+                logger_.event(events::HISTORY_SENT, requester_participant->number, 
+                              participant ? participant->number : 0, static_cast<uint32_t>(response.size()));
+            }
+        }
+        send_to_participant(requester, std::move(response));
     }
     
 private:
-    void send_to_participant(const std::string& participant_id, const std::vector<uint8_t>& message) {
+    void send_to_participant(const std::string& participant_id, std::vector<uint8_t> message) {
         auto participant = registry_.get_participant(participant_id);
         if (participant) {
-            try {
-                participant->connection->write(io::buffer(message));
-            } catch (const std::exception& e) {
-                logger_.record("Failed to send message to " + participant_id + ": " + e.what());
+            registry_.deliver(participant, ProtocolUtils::freeze(std::move(message)));
+        }
+    }
+};
+
+// Prometheus text exposition (format 0.0.4) of the server's counters and
+// gauges, served on GET /metrics. Event counts are monotonic _total
+// counters; rates such as messages or accepts per second are left to the
+// scraper. Rendering walks the online snapshot and takes each outbound
+// queue's lock once, so it is cheap enough to scrape every few seconds.
+class MetricsExporter {
+public:
+    static constexpr const char* CONTENT_TYPE = "text/plain; version=0.0.4; charset=utf-8";
+
+private:
+    ParticipantRegistry& registry_;
+    CommunicationRepository& repository_;
+    SystemLogger& logger_;
+    SystemMetrics& metrics_;
+    std::chrono::system_clock::time_point started_;
+    bool latency_reset_;
+    
+public:
+    MetricsExporter(ParticipantRegistry& registry,
+                    CommunicationRepository& repository,
+                    SystemLogger& logger,
+                    SystemMetrics& metrics,
+                    bool latency_reset = false)
+        : registry_(registry), repository_(repository), logger_(logger), metrics_(metrics),
+          started_(std::chrono::system_clock::now()), latency_reset_(latency_reset) {}
+    
+    // Whether POST /latency may reset the histograms (--latency-reset).
+    bool latency_reset() const {
+        return latency_reset_;
+    }
+    
+    std::string render() {
+        std::array<uint64_t, 4> by_availability{};
+        uint64_t connections = 0;
+        uint64_t deepest = 0;
+        for (const auto& participant : *registry_.get_all_participants()) {
+            by_availability[participant->availability.load() & 3]++;
+            if (auto queue = participant->get_outbound()) {
+                connections++;
+                deepest = std::max<uint64_t>(deepest, queue->depth());
+            }
+        }
+        
+        std::ostringstream out;
+        
+        family(out, "chat_participants", "gauge", "Connected participants by availability.");
+        out << "chat_participants{availability=\"available\"} " << by_availability[protocol::Availability::AVAILABLE] << '\n'
+            << "chat_participants{availability=\"busy\"} " << by_availability[protocol::Availability::BUSY] << '\n'
+            << "chat_participants{availability=\"away\"} " << by_availability[protocol::Availability::AWAY] << '\n';
+        
+        family(out, "chat_requests_total", "counter", "Client requests received, by type.");
+        for (size_t type = 0; type < metrics_.requests.size(); type++) {
+            out << "chat_requests_total{type=\"" << protocol::request_name(static_cast<uint8_t>(type)) << "\"} "
+                << metrics_.requests[type].load(std::memory_order_relaxed) << '\n';
+        }
+        
+        const auto& fanout = registry_.fanout();
+        family(out, "chat_broadcast_fanout", "histogram", "Connections each broadcast was queued for.");
+        uint64_t cumulative = 0;
+        for (size_t bucket = 0; bucket < FanoutHistogram::BUCKETS; bucket++) {
+            cumulative += fanout.counts[bucket].load(std::memory_order_relaxed);
+            out << "chat_broadcast_fanout_bucket{le=\"";
+            if (bucket + 1 < FanoutHistogram::BUCKETS) {
+                out << FanoutHistogram::upper_bound(bucket);
+            } else {
+                out << "+Inf";
             }
+            out << "\"} " << cumulative << '\n';
         }
+        out << "chat_broadcast_fanout_sum " << fanout.sum.load(std::memory_order_relaxed) << '\n'
+            << "chat_broadcast_fanout_count " << cumulative << '\n';
+        
+        gauge(out, "chat_outbound_connections", "Open WebSocket connections with an outbound queue.", connections);
+        gauge(out, "chat_outbound_queue_frames", "Frames waiting in all outbound queues.",
+              metrics_.outbound_frames_queued.load());
+        gauge(out, "chat_outbound_queue_bytes", "Bytes waiting in all outbound queues.",
+              metrics_.outbound_bytes_queued.load());
+        gauge(out, "chat_outbound_queue_frames_max", "Frames waiting in the deepest outbound queue.", deepest);
+        counter(out, "chat_outbound_frames_dropped_total", "Presence frames shed by a full outbound queue.",
+                metrics_.outbound_frames_dropped.load());
+        counter(out, "chat_outbound_evictions_total", "Connections closed for exceeding their outbound budget.",
+                metrics_.outbound_evictions.load());
+        counter(out, "chat_outbound_batches_total", "BATCH containers written.", metrics_.outbound_batches.load());
+        
+        gauge(out, "chat_pending_memory_bytes", "Held private messages kept in memory.", registry_.pending().memory_bytes());
+        gauge(out, "chat_pending_spooled", "Held private messages spilled to spool files.", registry_.pending().spooled());
+        counter(out, "chat_pending_delivered_total", "Held private messages delivered.", registry_.pending().delivered());
+        
+        gauge(out, "chat_public_history_bytes", "Bytes used by the public history ring.", repository_.public_history_bytes());
+        counter(out, "chat_log_dropped_total", "Log entries dropped because the async log ring was full.",
+                logger_.dropped());
+        counter(out, "chat_connections_accepted_total", "TCP connections accepted.", metrics_.connections_accepted.load());
+        counter(out, "chat_connections_rejected_total", "Handshakes rejected (bad, reserved or duplicate name).",
+                metrics_.connections_rejected.load());
+        gauge(out, "chat_start_time_seconds", "Server start time, in seconds since the Unix epoch.",
+              static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::seconds>(
+                  started_.time_since_epoch()).count()));
+        
+        return out.str();
+    }
+    
+    // Plain-text table of the request latency histograms, served on
+    // GET /latency. With `reset` (POST /latency) the counts start over
+    // after this dump.
+    std::string render_latency(bool reset) {
+        auto snapshot = reset ? metrics_.latency.snapshot_and_reset() : metrics_.latency.snapshot();
+        
+        static const char* const phases[] = {"parse", "handle", "write"};
+        std::ostringstream out;
+        out << "# request latency in us (bucket upper bounds, within 12.5%)"
+            << (reset ? "; reset" : "") << '\n'
+            << std::left << std::setw(22) << "type" << std::setw(8) << "phase" << std::right
+            << std::setw(12) << "count" << std::setw(11) << "mean" << std::setw(11) << "p50"
+            << std::setw(11) << "p90" << std::setw(11) << "p99" << std::setw(11) << "p99.9"
+            << std::setw(11) << "max" << '\n' << std::fixed << std::setprecision(1);
+        
+        for (size_t type = 0; type < LatencyRecorder::TYPES; type++) {
+            for (size_t phase = 0; phase < LatencyRecorder::PHASES; phase++) {
+                const auto& histogram = snapshot.at(static_cast<LatencyRecorder::Phase>(phase), type);
+                if (histogram.count == 0) {
+                    continue;
+                }
+                out << std::left << std::setw(22) << protocol::request_name(static_cast<uint8_t>(type))
+                    << std::setw(8) << phases[phase] << std::right << std::setw(12) << histogram.count
+                    << std::setw(11) << histogram.sum_ns / 1e3 / static_cast<double>(histogram.count);
+                for (double q : {0.5, 0.9, 0.99, 0.999, 1.0}) {
+                    out << std::setw(11) << static_cast<double>(histogram.percentile(q)) / 1e3;
+                }
+                out << '\n';
+            }
+        }
+        return out.str();
+    }
+
+private:
+    static void family(std::ostringstream& out, const char* name, const char* type, const char* help) {
+        out << "# HELP " << name << ' ' << help << "\n# TYPE " << name << ' ' << type << '\n';
+    }
+    
+    static void gauge(std::ostringstream& out, const char* name, const char* help, uint64_t value) {
+        family(out, name, "gauge", help);
+        out << name << ' ' << value << '\n';
+    }
+    
+    static void counter(std::ostringstream& out, const char* name, const char* help, uint64_t value) {
+        family(out, name, "counter", help);
+        out << name << ' ' << value << '\n';
     }
 };
 
 // Connection handler
-class ConnectionHandler {
+class ConnectionHandler : public std::enable_shared_from_this<ConnectionHandler> {
+    public:
+        static constexpr size_t MAX_IDENTIFIER_LENGTH = 1024;   // v2; v1 lengths are one byte
+        
     private:
         tcp::socket socket_;
+        std::shared_ptr<ws::stream<tcp::socket>> ws_;
+        std::shared_ptr<OutboundQueue> outbound_;
+        std::shared_ptr<Participant> participant_;
+        web::flat_buffer buffer_;
+        http::request<http::string_body> req_;
+        std::shared_ptr<http::response<http::string_body>> response_;
         std::string participant_id_;
+        io::ip::address client_address_;
+        protocol::WireVersion version_{protocol::WireVersion::V1};
+        BatchPolicy batch_policy_;      // the server's; enabled only if this client also asked for it
+        DeflatePolicy deflate_policy_;
+        OutboundBudget budget_;
         ParticipantRegistry& registry_;
         RequestHandler& request_handler_;
         SystemLogger& logger_;
+        SystemMetrics& metrics_;
+        MetricsExporter& exporter_;
         
     public:
         ConnectionHandler(tcp::socket socket, 
                          ParticipantRegistry& registry,
                          RequestHandler& request_handler,
-                         SystemLogger& logger)
+                         SystemLogger& logger,
+                         SystemMetrics& metrics,
+                         MetricsExporter& exporter,
+                         BatchPolicy batch_policy = {},
+                         DeflatePolicy deflate_policy = {},
+                         OutboundBudget budget = {})
             : socket_(std::move(socket)), 
+              batch_policy_(batch_policy),
+              deflate_policy_(deflate_policy),
+              budget_(budget),
               registry_(registry),
               request_handler_(request_handler),
-              logger_(logger) {}
-        
-        void process() {
-            try {
-                web::flat_buffer buffer;
-                http::request<http::string_body> req;
-        
-                http::read(socket_, buffer, req);
-        
-                std::string query_string = extract_query_string(req.target());
-                participant_id_ = ProtocolUtils::parse_query_parameter(query_string, "name");
-        
-                logger_.record("Parsed participant ID: [" + participant_id_ + "]");
-        
-                if (participant_id_.empty()) {
-                    reject_connection("Empty participant identifier");
-                    return;
-                }
-        
-                if (participant_id_ == "~") {
-                    reject_connection("Reserved participant identifier");
-                    return;
-                }
+              logger_(logger),
+              metrics_(metrics),
+              exporter_(exporter) {}
         
-                auto client_address = socket_.remote_endpoint().address();
+        tcp::socket::executor_type get_executor() {
+            return socket_.get_executor();
+        }
         
-                if (!registry_.register_participant(participant_id_, nullptr, client_address)) {
-                    reject_connection("Participant already connected");
-                    return;
+        // Starts the asynchronous handshake; the handler keeps itself alive
+        // through the pending operations until the connection closes.
+        void process() {
+            http::async_read(socket_, buffer_, req_,
+                [self = shared_from_this()](web::error_code ec, std::size_t) {
+                    self->on_http_request(ec);
+                });
+        }
+
+    private:
+        void on_http_request(web::error_code ec) {
+            if (ec) {
+                SYSTEM_LOG(logger_, LogLevel::WARN, "Connection handling error: " + ec.message());
+                return;
+            }
+            
+            if (!ws::is_upgrade(req_) && serve_http()) {
+                return;
+            }
+
+            std::string query_string = extract_query_string(req_.target());
+            participant_id_ = ProtocolUtils::parse_query_parameter(query_string, "name");
+    
+            SYSTEM_LOG(logger_, LogLevel::DEBUG, "Parsed participant ID: [" + participant_id_ + "]");
+    
+            if (participant_id_.empty()) {
+                reject_connection("Empty participant identifier");
+                return;
+            }
+    
+            if (participant_id_ == "~") {
+                reject_connection("Reserved participant identifier");
+                return;
+            }
+            
+            // A v2 client lists the subprotocol; anything else gets v1 frames.
+            std::vector<std::string> offered;
+            boost::split(offered, std::string(req_[http::field::sec_websocket_protocol]), boost::is_any_of(", "), 
+                         boost::token_compress_on);
+            auto offers = [&offered](const char* name) {
+                return std::find(offered.begin(), offered.end(), name) != offered.end();
+            };
+            
+            const char* subprotocol = nullptr;
+            if (batch_policy_.enabled && offers(protocol::V2_BATCH_SUBPROTOCOL)) {
+                subprotocol = protocol::V2_BATCH_SUBPROTOCOL;
+            } else {
+                batch_policy_.enabled = false;
+                if (offers(protocol::V2_SUBPROTOCOL)) {
+                    subprotocol = protocol::V2_SUBPROTOCOL;
                 }
-        
-                auto ws = std::make_shared<ws::stream<tcp::socket>>(std::move(socket_));
-                ws->set_option(ws::stream_base::timeout::suggested(web::role_type::server));
-        
-                try {
-                    ws->accept(req);
-                    logger_.record("WebSocket connection accepted for: " + participant_id_);
-                    registry_.update_connection(participant_id_, ws);
-                } catch (const std::exception& e) {
-                    logger_.record("WebSocket handshake failed for " + participant_id_ + ": " + e.what());
-                    return;
+            }
+            if (subprotocol) {
+                version_ = protocol::WireVersion::V2;
+            }
+            
+            size_t max_identifier = version_ == protocol::WireVersion::V1 ? 255 : MAX_IDENTIFIER_LENGTH;
+            if (participant_id_.size() > max_identifier) {
+                reject_connection("Participant identifier too long");
+                return;
+            }
+    
+            client_address_ = socket_.remote_endpoint(ec).address();
+    
+            if (!registry_.register_participant(participant_id_, nullptr, client_address_)) {
+                reject_connection("Participant already connected");
+                return;
+            }
+    
+            ws_ = std::make_shared<ws::stream<tcp::socket>>(std::move(socket_));
+            ws_->set_option(ws::stream_base::timeout::suggested(web::role_type::server));
+            if (deflate_policy_.enabled) {
+                ws_->set_option(deflate_policy_.option());
+            }
+            if (subprotocol) {
+                ws_->set_option(ws::stream_base::decorator([subprotocol](ws::response_type& res) {
+                    res.set(http::field::sec_websocket_protocol, subprotocol);
+                }));
+            }
+            ws_->async_accept(req_,
+                [self = shared_from_this()](web::error_code ec) {
+                    self->on_websocket_accept(ec);
+                });
+        }
+
+        void on_websocket_accept(web::error_code ec) {
+            if (ec) {
+                SYSTEM_LOG(logger_, LogLevel::WARN, "WebSocket handshake failed for " + participant_id_ + ": " + ec.message());
+                registry_.set_availability(participant_id_, protocol::Availability::OFFLINE);
+                return;
+            }
+
+            SYSTEM_LOG(logger_, LogLevel::INFO, "WebSocket connection accepted for: " + participant_id_ + 
+                       (batch_policy_.enabled ? " (v2, batch)" : version_ == protocol::WireVersion::V2 ? " (v2)" : ""));
+            ws_->binary(true);
+            outbound_ = std::make_shared<OutboundQueue>(ws_, participant_id_, logger_, metrics_, version_, batch_policy_,
+                                                        budget_);
+            registry_.update_connection(participant_id_, outbound_);
+            participant_ = registry_.get_participant(participant_id_);
+            logger_.event(events::CONNECTED, participant_->number);
+    
+            auto notification = ProtocolUtils::freeze_all([this](protocol::WireVersion version) {
+                return ProtocolUtils::create_new_participant_notification(participant_id_, version);
+            });
+            registry_.broadcast(notification);
+    
+            buffer_.consume(buffer_.size());
+            read_next();
+        }
+
+        void read_next() {
+            ws_->async_read(buffer_,
+                [self = shared_from_this()](web::error_code ec, std::size_t) {
+                    self->on_read(ec);
+                });
+        }
+
+        void on_read(web::error_code ec) {
+            if (ec) {
+                if (ec == ws::error::closed) {
+                    SYSTEM_LOG(logger_, LogLevel::INFO, "Connection closed by participant: " + participant_id_);
+                } else {
+                    SYSTEM_LOG(logger_, LogLevel::WARN, "Error reading from participant " + participant_id_ + ": " + ec.message());
                 }
-        
-                logger_.record("Intentando registrar a " + participant_id_);
-                logger_.record("ws es nulo? " + std::string(ws == nullptr ? "sí" : "no"));
+                disconnect();
+                return;
+            }
 
-                registry_.register_participant(participant_id_, ws, client_address);
-        
-                auto notification = ProtocolUtils::create_new_participant_notification(participant_id_);
-                registry_.broadcast(notification);
-        
-                web::flat_buffer msg_buffer;
-        
-                while (true) {
-                    try {
-                        ws->read(msg_buffer);
-                        auto data = web::buffers_to_string(msg_buffer.data());
-                        std::vector<uint8_t> binary_data(data.begin(), data.end());
-                        msg_buffer.consume(msg_buffer.size());
-        
-                        if (!binary_data.empty()) {
-                            handle_client_message(binary_data);
-                        }
-        
-                    } catch (const web::error_code& ec) {
-                        if (ec == ws::error::closed) {
-                            logger_.record("Connection closed by participant: " + participant_id_);
-                            break;
-                        } else {
-                            logger_.record("Error reading from participant " + participant_id_ + ": " + ec.message());
-                            break;
-                        }
-                    } catch (const std::exception& e) {
-                        logger_.record("Error processing message from " + participant_id_ + ": " + e.what());
-                        break;
-                    }
+            // The frame is parsed in place; the buffer keeps its capacity
+            // across reads, so steady-state reads do not allocate.
+            try {
+                auto frame = buffer_.cdata();
+                if (frame.size() > 0) {
+                    handle_client_message(static_cast<const uint8_t*>(frame.data()), frame.size());
                 }
-        
-                registry_.set_availability(participant_id_, protocol::Availability::OFFLINE);
-                logger_.record("Participant " + participant_id_ + " marked as OFFLINE");
-        
-                auto notification_offline = ProtocolUtils::create_availability_update(
-                    participant_id_, protocol::Availability::OFFLINE);
-                registry_.broadcast(notification_offline);
-        
+                buffer_.consume(buffer_.size());
             } catch (const std::exception& e) {
-                logger_.record("Connection handling error: " + std::string(e.what()));
+                SYSTEM_LOG(logger_, LogLevel::WARN, "Error processing message from " + participant_id_ + ": " + e.what());
+                disconnect();
+                return;
             }
-        }            
 
-    private:
+            read_next();
+        }
+
+        void disconnect() {
+            outbound_->close();
+            registry_.set_availability(participant_id_, protocol::Availability::OFFLINE);
+            SYSTEM_LOG(logger_, LogLevel::INFO, "Participant " + participant_id_ + " marked as OFFLINE");
+            logger_.event(events::DISCONNECTED, participant_->number);
+    
+            auto notification_offline = ProtocolUtils::freeze_all([this](protocol::WireVersion version) {
+                return ProtocolUtils::create_availability_update(participant_id_, protocol::Availability::OFFLINE, version);
+            });
+            registry_.broadcast(notification_offline);
+        }
+
+        // Plain HTTP requests on the WebSocket port. Returns false for
+        // anything that should go on to the handshake.
+        bool serve_http() {
+            auto target = req_.target();
+            auto path = target.substr(0, target.find('?'));
+            if (path != "/metrics" && path != "/latency") {
+                return false;
+            }
+            
+            // Reading is always allowed; resetting the latency counts is a
+            // state change, so it takes a POST and --latency-reset.
+            bool reset = path == "/latency" && req_.method() == http::verb::post && exporter_.latency_reset();
+            if (req_.method() != http::verb::get && !reset) {
+                send_response(http::status::method_not_allowed, "text/plain", "Method not allowed");
+            } else if (path == "/metrics") {
+                send_response(http::status::ok, MetricsExporter::CONTENT_TYPE, exporter_.render());
+            } else {
+                send_response(http::status::ok, "text/plain; charset=utf-8", exporter_.render_latency(reset));
+            }
+            return true;
+        }
+        
         void reject_connection(const std::string& reason) {
-            http::response<http::string_body> res{http::status::bad_request, 11};
-            res.set(http::field::server, "MessagingSystem");
-            res.set(http::field::content_type, "text/plain");
-            res.body() = reason;
-            res.prepare_payload();
+            metrics_.connections_rejected++;
+            SYSTEM_LOG(logger_, LogLevel::INFO, "Connection rejected for " + participant_id_ + ": " + reason);
+            send_response(http::status::bad_request, "text/plain", reason);
+        }
+        
+        // Writes one response and closes the connection.
+        void send_response(http::status status, const char* content_type, std::string body) {
+            response_ = std::make_shared<http::response<http::string_body>>(status, 11);
+            response_->set(http::field::server, "MessagingSystem");
+            response_->set(http::field::content_type, content_type);
+            response_->keep_alive(false);
+            response_->body() = std::move(body);
+            response_->prepare_payload();
             
-            http::write(socket_, res);
-            logger_.record("Connection rejected for " + participant_id_ + ": " + reason);
+            http::async_write(socket_, *response_,
+                [self = shared_from_this()](web::error_code ec, std::size_t) {
+                    self->socket_.shutdown(tcp::socket::shutdown_send, ec);
+                });
         }
         
         std::string extract_query_string(boost::beast::string_view target) {
@@ -925,106 +4103,315 @@ class ConnectionHandler {
             return "";
         }
         
-        void handle_client_message(const std::vector<uint8_t>& data) {
-            if (data.empty()) {
-                return;
-            }
+        void handle_client_message(const uint8_t* data, size_t size) {
+            auto received = std::chrono::steady_clock::now();
+            uint8_t type = data[0];
+            logger_.event(events::REQUEST, participant_->number, 0, static_cast<uint32_t>(size), type);
+            metrics_.requests[type < metrics_.requests.size() ? type : 0]++;
             
-            switch (data[0]) {
-                case protocol::ClientRequest::GET_PARTICIPANTS:
-                    request_handler_.handle_get_participants(participant_id_);
-                    break;
-                    
-                case protocol::ClientRequest::PARTICIPANT_INFO:
-                    request_handler_.handle_participant_info(participant_id_, data);
-                    break;
-                    
-                case protocol::ClientRequest::SET_AVAILABILITY:
-                    request_handler_.handle_set_availability(participant_id_, data);
-                    break;
-                    
-                case protocol::ClientRequest::SEND_COMMUNICATION:
-                    request_handler_.handle_send_communication(participant_id_, data);
-                    break;
-                    
-                case protocol::ClientRequest::FETCH_COMMUNICATIONS:
-                    request_handler_.handle_fetch_communications(participant_id_, data);
-                    break;
-                    
-                default:
-                    logger_.record("Unknown message type from " + participant_id_ + ": " + 
-                                  std::to_string(data[0]));
-                    break;
-            }
+            RequestReader reader(data, size, version_);
+            request_handler_.dispatch(participant_id_, reader);
+            
+            auto handled = std::chrono::steady_clock::now();
+            auto parsed = reader.parsed_at() < received ? received : reader.parsed_at();
+            metrics_.latency.record(LatencyRecorder::PARSE, type, parsed - received);
+            metrics_.latency.record(LatencyRecorder::HANDLE, type, handled - parsed);
+            outbound_->time_write(type, handled);
         }
     };
 
+// Command line configuration
+struct ServerOptions {
+    unsigned short port{0};
+    unsigned int threads{std::max(1u, std::thread::hardware_concurrency())};
+    std::string log_file{"messaging_system.log"};
+    bool async_log{false};
+    LogLevel log_level{LogLevel::INFO};
+    int inactivity_timeout{120};
+    std::string event_log;
+    std::string data_dir;
+    size_t journal_segments{MessageJournal::DEFAULT_MAX_SEGMENTS};
+    bool batch{false};
+    int flush_deadline_ms{0};
+    DeflatePolicy deflate;
+    OutboundBudget budget;
+    std::string spool_dir;      // defaults to DATA_DIR/spool; without either, pending messages stay in memory
+    size_t pending_memory_bytes{PendingStore::DEFAULT_MEMORY_LIMIT};
+    bool latency_reset{false};  // accept POST /latency
+};
+
 // Main system class
 class MessageSystem {
 private:
+    SystemLogger logger_;
+    SystemMetrics metrics_;
     io::io_context io_context_;
+    io::steady_timer stats_timer_;
+    io::signal_set signals_;
     tcp::acceptor acceptor_;
     ParticipantRegistry registry_;
+    std::unique_ptr<MessageJournal> journal_;
     CommunicationRepository repository_;
     RequestHandler request_handler_;
     ActivityMonitor activity_monitor_;
-    SystemLogger logger_;
+    MetricsExporter exporter_;
+    unsigned int threads_;
+    BatchPolicy batch_policy_;
+    DeflatePolicy deflate_policy_;
+    OutboundBudget budget_;
     
 public:
-    MessageSystem(unsigned short port, const std::string& log_file = "messaging_system.log")
-        : io_context_(1),
-          acceptor_(io_context_, {tcp::v4(), port}),
+    explicit MessageSystem(const ServerOptions& options)
+        : logger_(options.log_file, options.async_log, options.event_log),
+          io_context_(static_cast<int>(options.threads)),
+          stats_timer_(io_context_),
+          signals_(io_context_, SIGINT, SIGTERM),
+          acceptor_(io_context_, {tcp::v4(), options.port}),
           registry_(logger_),
           repository_(),
           request_handler_(registry_, repository_, logger_),
-          logger_(log_file),
-          activity_monitor_(registry_, logger_) {
+          activity_monitor_(io_context_, registry_, logger_),
+          exporter_(registry_, repository_, logger_, metrics_, options.latency_reset),
+          threads_(options.threads),
+          batch_policy_{options.batch, std::chrono::milliseconds(options.flush_deadline_ms)},
+          deflate_policy_(options.deflate),
+          budget_(options.budget) {
         
+        logger_.set_level(options.log_level);
         acceptor_.set_option(io::socket_base::reuse_address(true));
-        logger_.record("System initialized on port " + std::to_string(port));
+        
+        std::string spool_dir = !options.spool_dir.empty() ? options.spool_dir :
+                                !options.data_dir.empty() ? options.data_dir + "/spool" : "";
+        registry_.pending().configure(spool_dir, options.pending_memory_bytes);
+        
+        if (!options.data_dir.empty()) {
+            auto started = std::chrono::steady_clock::now();
+            journal_ = std::make_unique<MessageJournal>(options.data_dir, logger_, MessageJournal::DEFAULT_SEGMENT_BYTES,
+                                                        options.journal_segments);
+            size_t replayed = repository_.attach_journal(*journal_, registry_);
+            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - started);
+            SYSTEM_LOG(logger_, LogLevel::INFO, "Historial recuperado de " + options.data_dir + ": " + std::to_string(replayed) + 
+                       " mensajes en " + std::to_string(elapsed.count()) + " ms");
+        }
+        if (deflate_policy_.enabled) {
+            SYSTEM_LOG(logger_, LogLevel::INFO, "permessage-deflate habilitado: window bits " + std::to_string(deflate_policy_.window_bits) + 
+                       ", mem level " + std::to_string(deflate_policy_.mem_level));
+            if (!DeflatePolicy::supports_min_size()) {
+                SYSTEM_LOG(logger_, LogLevel::WARN, "Esta versión de Beast no admite un tamaño mínimo; "
+                           "se comprimen todos los mensajes");
+            }
+        }
+        SYSTEM_LOG(logger_, LogLevel::INFO, "System initialized on port " + std::to_string(options.port) + 
+                   " with " + std::to_string(threads_) + " worker threads");
     }
     
     void set_inactivity_timeout(int seconds) {
         activity_monitor_.set_timeout(std::chrono::seconds(seconds));
     }
     
+    // Every worker runs the same io_context; each session is bound to its
+    // own strand, so its handlers never run concurrently with each other.
     void run() {
-        logger_.record("System Running...");
+        SYSTEM_LOG(logger_, LogLevel::INFO, "System Running...");
+        accept_next();
+        schedule_stats();
         
-        while (true) {
-            tcp::socket socket{io_context_};
-            acceptor_.accept(socket);
-            
-            std::string remote_address = socket.remote_endpoint().address().to_string();
-            unsigned short remote_port = socket.remote_endpoint().port();
-            
-            logger_.record("New connection from " + remote_address + ":" + std::to_string(remote_port));
+        // Stop cleanly so buffered log output reaches disk on shutdown.
+        signals_.async_wait([this](web::error_code ec, int signal) {
+            if (!ec) {
+                SYSTEM_LOG(logger_, LogLevel::INFO, "Signal " + std::to_string(signal) + " received, shutting down");
+                io_context_.stop();
+            }
+        });
+        
+        std::vector<std::thread> workers;
+        workers.reserve(threads_ - 1);
+        for (unsigned int i = 1; i < threads_; i++) {
+            workers.emplace_back([this]() { io_context_.run(); });
+        }
+        
+        io_context_.run();
+        
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+private:
+    void accept_next() {
+        acceptor_.async_accept(io::make_strand(io_context_), [this](web::error_code ec, tcp::socket socket) {
+            if (ec) {
+                SYSTEM_LOG(logger_, LogLevel::WARN, "Accept failed: " + ec.message());
+            } else {
+                on_accept(std::move(socket));
+            }
+            accept_next();
+        });
+    }
+
+    void on_accept(tcp::socket socket) {
+        web::error_code ec;
+        auto endpoint = socket.remote_endpoint(ec);
+        if (ec) {
+            return;
+        }
+        
+        SYSTEM_LOG(logger_, LogLevel::DEBUG, "New connection from " + endpoint.address().to_string() + ":" + std::to_string(endpoint.port()));
+        
+        socket.set_option(tcp::socket::keep_alive(true), ec);
+        metrics_.connections_accepted++;
+        
+        auto handler = std::make_shared<ConnectionHandler>(std::move(socket), registry_, request_handler_, logger_, 
+                                                           metrics_, exporter_, batch_policy_, deflate_policy_, budget_);
+        io::dispatch(handler->get_executor(), [handler]() { handler->process(); });
+    }
+    
+    void schedule_stats() {
+        stats_timer_.expires_after(std::chrono::seconds(60));
+        stats_timer_.async_wait([this](web::error_code ec) {
+            if (ec) {
+                return;
+            }
             
-            socket.set_option(tcp::socket::keep_alive(true));
+            size_t online = 0;
+            size_t deepest = 0;
+            for (const auto& participant : *registry_.get_all_participants()) {
+                online++;
+                if (auto queue = participant->get_outbound()) {
+                    deepest = std::max(deepest, queue->depth());
+                }
+            }
             
-            std::thread([this, sock = std::move(socket)]() mutable {
-                ConnectionHandler handler(std::move(sock), registry_, request_handler_, logger_);
-                handler.process();
-            }).detach();
-        }
+            SYSTEM_LOG(logger_, LogLevel::INFO, "Stats: " + std::to_string(online) + " online, outbound queued " +
+                       std::to_string(metrics_.outbound_frames_queued.load()) + " frames / " +
+                       std::to_string(metrics_.outbound_bytes_queued.load()) + " bytes (deepest " +
+                       std::to_string(deepest) + "), dropped " +
+                       std::to_string(metrics_.outbound_frames_dropped.load()) + ", evicted " +
+                       std::to_string(metrics_.outbound_evictions.load()) + ", batches " +
+                       std::to_string(metrics_.outbound_batches.load()) + " carrying " +
+                       std::to_string(metrics_.outbound_batched_frames.load()) + " frames, pending " +
+                       std::to_string(registry_.pending().memory_bytes()) + " bytes in memory / " +
+                       std::to_string(registry_.pending().spooled()) + " spooled / " +
+                       std::to_string(registry_.pending().delivered()) + " delivered, public history " +
+                       std::to_string(repository_.public_history_bytes()) + " bytes (" +
+                       std::to_string(static_cast<int>(repository_.public_bytes_per_message())) + " per message)");
+            schedule_stats();
+        });
     }
 };
 
 
+// Benchmarks and tools include this file with CHAT_SERVIDOR_NO_MAIN defined
+// to reuse the server classes without its entry point.
+#ifndef CHAT_SERVIDOR_NO_MAIN
+static void print_usage(const char* program) {
+    std::cerr << "Usage: " << program << " <port> [--threads N] [--async-log]"
+              << " [--log-level debug|info|warn|error] [--event-log FILE]"
+              << " [--inactivity-timeout SECONDS] [--data-dir DIR] [--journal-segments N]"
+              << " [--batch] [--flush-deadline-ms MS]"
+              << " [--deflate] [--deflate-min-size BYTES] [--deflate-window-bits 9-15]"
+              << " [--deflate-mem-level 1-9] [--max-queue-frames N] [--max-queue-bytes BYTES]"
+              << " [--spool-dir DIR] [--pending-memory-bytes BYTES] [--latency-reset]" << std::endl;
+}
+
+static bool parse_options(int argc, char* argv[], ServerOptions& options) {
+    if (argc < 2) {
+        return false;
+    }
+    
+    options.port = static_cast<unsigned short>(std::stoi(argv[1]));
+    
+    for (int i = 2; i < argc; i++) {
+        std::string flag = argv[i];
+        if (flag == "--async-log") {
+            options.async_log = true;
+            continue;
+        }
+        if (flag == "--batch") {
+            options.batch = true;
+            continue;
+        }
+        if (flag == "--deflate") {
+            options.deflate.enabled = true;
+            continue;
+        }
+        if (flag == "--latency-reset") {
+            options.latency_reset = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            return false;
+        }
+        std::string value = argv[++i];
+        
+        if (flag == "--threads") {
+            options.threads = static_cast<unsigned int>(std::max(1, std::stoi(value)));
+        } else if (flag == "--log-level") {
+            static const std::unordered_map<std::string, LogLevel> levels = {
+                {"debug", LogLevel::DEBUG}, {"info", LogLevel::INFO},
+                {"warn", LogLevel::WARN}, {"error", LogLevel::ERROR}
+            };
+            auto it = levels.find(value);
+            if (it == levels.end()) {
+                return false;
+            }
+            options.log_level = it->second;
+        } else if (flag == "--event-log") {
+            options.event_log = value;
+        } else if (flag == "--inactivity-timeout") {
+            options.inactivity_timeout = std::max(1, std::stoi(value));
+        } else if (flag == "--data-dir") {
+            options.data_dir = value;
+        } else if (flag == "--journal-segments") {
+            options.journal_segments = static_cast<size_t>(std::max(1, std::stoi(value)));
+        } else if (flag == "--flush-deadline-ms") {
+            options.flush_deadline_ms = std::max(0, std::stoi(value));
+        } else if (flag == "--max-queue-frames") {
+            options.budget.max_frames = static_cast<size_t>(std::max(1, std::stoi(value)));
+        } else if (flag == "--max-queue-bytes") {
+            options.budget.max_bytes = static_cast<size_t>(std::max(1L, std::stol(value)));
+        } else if (flag == "--spool-dir") {
+            options.spool_dir = value;
+        } else if (flag == "--pending-memory-bytes") {
+            options.pending_memory_bytes = static_cast<size_t>(std::max(0L, std::stol(value)));
+        } else if (flag == "--deflate-min-size") {
+            if (!DeflatePolicy::supports_min_size()) {
+                std::cerr << "--deflate-min-size requires a Beast release with permessage_deflate::msg_size_threshold" << std::endl;
+                return false;
+            }
+            options.deflate.min_size = static_cast<size_t>(std::max(0, std::stoi(value)));
+        } else if (flag == "--deflate-window-bits") {
+            options.deflate.window_bits = std::stoi(value);
+            if (options.deflate.window_bits < 9 || options.deflate.window_bits > 15) {
+                return false;
+            }
+        } else if (flag == "--deflate-mem-level") {
+            options.deflate.mem_level = std::stoi(value);
+            if (options.deflate.mem_level < 1 || options.deflate.mem_level > 9) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
 // Entry point
 int main(int argc, char* argv[]) {
     try {
-        if (argc != 2) {
-            std::cerr << "Usage: " << argv[0] << " <port>" << std::endl;
+        ServerOptions options;
+        if (!parse_options(argc, argv, options)) {
+            print_usage(argv[0]);
             return 1;
         }
         
-        unsigned short port = static_cast<unsigned short>(std::stoi(argv[1]));
+        MessageSystem system(options);
+        system.set_inactivity_timeout(options.inactivity_timeout);
         
-        MessageSystem system(port);
-        system.set_inactivity_timeout(120);
-        
-        std::cout << "Messaging system running on port " << port << std::endl;
+        std::cout << "Messaging system running on port " << options.port << std::endl;
         system.run();
         
     } catch (const std::exception& e) {
@@ -1033,4 +4420,5 @@ int main(int argc, char* argv[]) {
     }
     
     return 0;
-}
\ No newline at end of file
+}
+#endif